@@ -0,0 +1,77 @@
+#include <atomic>
+#include <cstdlib>
+#include <new>
+#include "alloccount.hpp"
+
+#ifdef BSPVIEWER_COUNT_ALLOCATIONS
+
+static std::atomic<unsigned long long> allocations(0);
+
+void* operator new(std::size_t size)
+{
+    allocations++;
+    void* memory = std::malloc(size ? size : 1);
+    if (!memory)
+        throw std::bad_alloc();
+    return memory;
+}
+
+void* operator new[](std::size_t size)
+{
+    return operator new(size);
+}
+
+void* operator new(std::size_t size, const std::nothrow_t&) noexcept
+{
+    allocations++;
+    return std::malloc(size ? size : 1);
+}
+
+void* operator new[](std::size_t size, const std::nothrow_t&) noexcept
+{
+    return operator new(size, std::nothrow);
+}
+
+void operator delete(void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete(void* memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+void operator delete[](void* memory, const std::nothrow_t&) noexcept
+{
+    std::free(memory);
+}
+
+unsigned long long allocationCount()
+{
+    return allocations;
+}
+
+bool allocationsCounted()
+{
+    return true;
+}
+
+#else
+
+unsigned long long allocationCount()
+{
+    return 0;
+}
+
+bool allocationsCounted()
+{
+    return false;
+}
+
+#endif
@@ -0,0 +1,10 @@
+#ifndef ALLOCCOUNT_HPP
+#define ALLOCCOUNT_HPP
+
+// Number of heap allocations made through operator new so far. Only builds
+// with BSPVIEWER_COUNT_ALLOCATIONS defined count them, elsewhere the count
+// stays at zero and allocationsCounted() returns false.
+unsigned long long allocationCount();
+bool allocationsCounted();
+
+#endif // ALLOCCOUNT_HPP
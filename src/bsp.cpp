@@ -1,12 +1,30 @@
+#include <algorithm>
+#include <chrono>
 #include <cmath>
+#include <cstdlib>
 #include <cstddef>
-#include <array>
+#include <functional>
 #include <iostream>
+#include <limits>
 #include <glm/gtc/matrix_transform.hpp>
 #include <physfs.h>
 #include "filestream.hpp"
+#include "indirect.hpp"
+#include "jobs.hpp"
+#include "mapcache.hpp"
+#include "texture.hpp"
+#include "mappedfile.hpp"
 #include "bsp.hpp"
 
+#if defined(_MSC_VER) && (defined(_M_IX86) || defined(_M_X64))
+#include <xmmintrin.h>
+#define PREFETCH(address) _mm_prefetch((const char*)(address), _MM_HINT_T0)
+#elif defined(__GNUC__)
+#define PREFETCH(address) __builtin_prefetch(address)
+#else
+#define PREFETCH(address)
+#endif
+
 enum
 {
     ENTITY = 0,
@@ -74,6 +92,37 @@ const int SURF_ALPHASHADOW  = 0x10000;
 const int SURF_NODLIGHT     = 0x20000;
 const int SURF_SURFDUST     = 0x40000;
 
+// Levels of the BSP split off on the render thread before the subtrees
+// below are culled in parallel, and faces per batch of the face test
+const int CULL_SPLIT_DEPTH = 6;
+const int CULL_FACE_GRAIN = 4096;
+
+// Faces whose plane passes this close to the eye are never treated as
+// backfacing
+const float BACKFACE_EPSILON = 1.f;
+
+// Smallest face considered as an occluder, in square units, and the most
+// drawn into the occlusion buffer per frame
+const float OCCLUDER_MIN_AREA = 128.f * 64.f;
+const size_t MAX_OCCLUDERS = 64;
+// A corner of an occluder's vertex loop counts as straight while the sine
+// of its turn is below CONVEX_EPSILON, and the loop's area may differ from
+// the area of the face's triangles by this fraction
+const float CONVEX_EPSILON = 1e-3f;
+const float OCCLUDER_AREA_TOLERANCE = 0.01f;
+
+// Swept traces stop this far short of the plane they hit so the next one
+// doesn't start inside the brush
+const float SURFACE_CLIP_EPSILON = 0.125f;
+// Planes a sliding move may be deflected by in one step
+const int MAX_SLIDES = 4;
+
+// Side of a cell of the grid inline models are looked up in by traces
+const float INSTANCE_GRID_CELL = 512.f;
+
+// How much wider than the view the frustum used to build the draw lists is
+const float VIEW_MARGIN = 1.15f;
+
 const void* VertexPosition = (void*)(long)offsetof(Vertex, position);
 const void* VertexTexCoord = (void*)(long)offsetof(Vertex, texCoord);
 const void* VertexLMCoord = (void*)(long)offsetof(Vertex, lmCoord);
@@ -124,6 +173,34 @@ struct RawLightVol
     unsigned char direction[2];
 };
 
+// Lightmaps are packed into square atlases of 128x128 tiles, the last tile
+// is a flat grey fallback for faces without a lightmap.
+struct LightMapAtlas
+{
+    int size;
+    int tilesPerRow;
+    int tilesPerAtlas;
+    int count;
+
+    LightMapAtlas(int tiles, int maxSize)
+    {
+        int needed = int(ceil(sqrt(float(tiles)))) * 128;
+        size = 128;
+        while (size < needed && size * 2 <= maxSize)
+            size *= 2;
+        tilesPerRow = size / 128;
+        tilesPerAtlas = tilesPerRow * tilesPerRow;
+        count = (tiles + tilesPerAtlas - 1) / tilesPerAtlas;
+    }
+
+    void place(int tile, int& atlas, int& x, int& y) const
+    {
+        atlas = tile / tilesPerAtlas;
+        x = (tile % tilesPerAtlas) % tilesPerRow * 128;
+        y = (tile % tilesPerAtlas) / tilesPerRow * 128;
+    }
+};
+
 Vertex operator+(const Vertex& v1, const Vertex& v2)
 {
     Vertex temp;
@@ -187,9 +264,9 @@ void Map::tesselate(int controlOffset, int controlWidth, int vOffset, int iOffse
         }
     }
 
-    for (int i = 0; i <= bezierLevel; ++i)
+    for (int i = 0; i < bezierLevel; ++i)
     {
-        for (int j = 0; j <= bezierLevel; ++j)
+        for (int j = 0; j < bezierLevel; ++j)
         {
             int offset = iOffset + (i * bezierLevel + j) * 6;
             meshIndexArray[offset + 0] = (i    ) * L1 + (j    ) + vOffset;
@@ -205,11 +282,26 @@ void Map::tesselate(int controlOffset, int controlWidth, int vOffset, int iOffse
 
 #include "shaders.inc"
 
+// Returns a generation no element of stamps carries yet. The stamps are
+// only cleared when the counter wraps around.
+static unsigned int nextGeneration(std::vector<unsigned int>& stamps, unsigned int& generation)
+{
+    if (++generation == 0)
+    {
+        std::fill(stamps.begin(), stamps.end(), 0);
+        generation = 1;
+    }
+    return generation;
+}
+
 RenderPass::RenderPass(Map* parent, const glm::vec3& position, const glm::mat4& matrix)
     : pos(position)
     , frutsum(matrix)
+    , matrix(matrix)
+    , eyeCentre(position)
+    , eyeExtent(0.f)
 {
-    renderedFaces.resize(parent->faceArray.size(), false);
+    stamp = nextGeneration(parent->faceStampArray, parent->faceGeneration);
 }
 
 TracePass::TracePass(Map* parent, const glm::vec3& pos, const glm::vec3 &oldPos, float rad)
@@ -217,17 +309,70 @@ TracePass::TracePass(Map* parent, const glm::vec3& pos, const glm::vec3 &oldPos,
     , oldPosition(oldPos)
     , radius(rad)
 {
-    tracedBrushes.resize(parent->brushArray.size(), false);
+    stamp = nextGeneration(parent->brushStampArray, parent->brushGeneration);
+}
+
+SweepPass::SweepPass(Map* parent, const glm::vec3& start, const glm::vec3& end, const glm::vec3& extent, float radius)
+    : start(start)
+    , end(end)
+    , extent(extent)
+    , radius(radius)
+{
+    glm::vec3 grow = extent + glm::vec3(radius + 1.f);
+    min = glm::min(start, end) - grow;
+    max = glm::max(start, end) + grow;
+
+    result.fraction = 1.f;
+    result.endPosition = end;
+    result.plane.normal = glm::vec3(0.f);
+    result.plane.distance = 0.f;
+    result.surface = 0;
+    result.contents = 0;
+    result.startSolid = false;
+    result.allSolid = false;
+    stamp = nextGeneration(parent->brushStampArray, parent->brushGeneration);
+}
+
+float SweepPass::offset(const glm::vec3& normal) const
+{
+    return radius + glm::dot(glm::abs(normal), extent);
 }
 
-Map::Map()
+Map::Map(bool headless)
     : program(0)
     , vertexBuffer(0)
     , meshIndexBuffer(0)
+    , matrixLoc(-1)
+    , indirect(NULL)
+    , useIndirect(false)
+    , headless(headless)
+    , visCluster(-2)
+    , visArea(-1)
+    , areasChanged(false)
+    , visFrame(0)
     , bezierLevel(3)
+    , fileIndex(NULL)
+    , areaCount(0)
+    , faceGeneration(0)
+    , brushGeneration(0)
+    , useParallelCulling(true)
+    , useOcclusion(true)
+    , faceCache(8 * 1024 * 1024)
+    , useFaceCache(true)
+    , gridWidth(0)
+    , gridHeight(0)
+    , gridDirty(true)
+    , instanceGeneration(0)
+    , useTemporal(true)
+    , lastLeaf(-1)
 {
+    if (headless)
+        return;
+
     glGenBuffers(1, &vertexBuffer);
     glGenBuffers(1, &meshIndexBuffer);
+    glGenBuffers(1, &opaqueList.indexBuffer);
+    glGenBuffers(1, &transparentList.indexBuffer);
 
     GLint status;
 
@@ -291,25 +436,104 @@ Map::Map()
         return;
     }
 
-    programLoc["matrix"] = glGetUniformLocation(program, "matrix");
-    programLoc["texture"] = glGetUniformLocation(program, "texture");
-    programLoc["lightmap"] = glGetUniformLocation(program, "lightmap");
+    matrixLoc = glGetUniformLocation(program, "matrix");
+
+    // The samplers never change units, set them once.
+    glUseProgram(program);
+    glUniform1i(glGetUniformLocation(program, "texture"), 0);
+    glUniform1i(glGetUniformLocation(program, "lightmap"), 1);
+    glUseProgram(0);
+}
+
+template <typename T>
+static bool lumpView(const MappedFile& file, const Header& header, int lump, ArrayView<T>& out)
+{
+    const Lump& info = header.lumps[lump];
+    if (info.offset < 0 || info.size < 0)
+        return false;
+    return file.view(info.offset, info.size, out);
+}
+
+// Lists the nodes the root reaches depth first, front child before back,
+// and where each node lands in that order, -1 for the unreachable ones
+static void depthFirstNodes(const std::vector<Node>& nodes, std::vector<int>& order, std::vector<int>& renumber)
+{
+    order.clear();
+    renumber.assign(nodes.size(), -1);
+    if (nodes.empty())
+        return;
+
+    std::vector<int> stack(1, 0);
+    renumber[0] = 0;
+    while (!stack.empty())
+    {
+        int index = stack.back();
+        stack.pop_back();
+        renumber[index] = order.size();
+        order.push_back(index);
+        for (int j = 1; j >= 0; j--)
+        {
+            int child = nodes[index].children[j];
+            if (child >= 0 && child < (int)nodes.size() && renumber[child] == -1)
+            {
+                renumber[child] = 0;
+                stack.push_back(child);
+            }
+        }
+    }
+}
+
+Map::~Map()
+{
+    delete indirect;
+    if (headless)
+        return;
+    for (size_t i = 0; i < shaderArray.size(); i++)
+    {
+        if (shaderArray[i].texture)
+            glDeleteTextures(1, &shaderArray[i].texture);
+    }
+    if (!lightMapArray.empty())
+        glDeleteTextures(lightMapArray.size(), &lightMapArray[0]);
+    glDeleteBuffers(1, &vertexBuffer);
+    glDeleteBuffers(1, &meshIndexBuffer);
+    glDeleteBuffers(1, &opaqueList.indexBuffer);
+    glDeleteBuffers(1, &transparentList.indexBuffer);
+    if (program)
+        glDeleteProgram(program);
+}
+
+void Map::setFileIndex(const FileIndex* index)
+{
+    fileIndex = index;
+    textureCache.setFileIndex(index);
+}
+
+void Map::setCacheDir(const std::string& dir)
+{
+    cacheDir = dir;
+    textureCache.setDirectory(dir);
 }
 
 bool Map::load(std::string filename)
 {
-    glEnable(GL_TEXTURE_2D);
+    if (!headless)
+        glEnable(GL_TEXTURE_2D);
 
-    PHYSFS_File* file = PHYSFS_openRead(filename.c_str());
-    if (!file)
+    MappedFile file;
+    if (!file.open(filename))
     {
         std::cout << filename.c_str() << ": " << PHYSFS_getLastError() << std::endl;
         return false;
     }
 
-    PHYSFS_seek(file, 0);
-    Header header;
-    PHYSFS_read(file, &header, sizeof(Header), 1);
+    ArrayView<Header> headerView;
+    if (!file.view(0, sizeof(Header), headerView) || headerView.empty())
+    {
+        std::cout << "Invalid file" << std::endl;
+        return false;
+    }
+    const Header& header = headerView[0];
     if (std::string(header.magic, 4) != "IBSP")
     {
         std::cout << "Invalid file" << std::endl;
@@ -321,450 +545,2152 @@ bool Map::load(std::string filename)
         return false;
     }
 
-    PHYSFS_seek(file, header.lumps[ENTITY].offset);
-    std::string rawEntity;
-    rawEntity.resize(header.lumps[ENTITY].size);
-    PHYSFS_read(file, &rawEntity[0], 1, header.lumps[ENTITY].size);
+    ArrayView<char> entities;
+    ArrayView<RawShader> rawShaders;
+    ArrayView<Plane> planes;
+    ArrayView<Node> nodes;
+    ArrayView<Leaf> leaves;
+    ArrayView<int> leafFaces;
+    ArrayView<int> leafBrushes;
+    ArrayView<Model> models;
+    ArrayView<Brush> brushes;
+    ArrayView<BrushSide> brushSides;
+    ArrayView<Vertex> vertices;
+    ArrayView<GLuint> meshVertices;
+    ArrayView<Effect> effects;
+    ArrayView<RawFace> rawFaces;
+    ArrayView<unsigned char> lightMaps;
+    ArrayView<RawLightVol> rawLightVols;
+    ArrayView<int> visHeader;
+    if (!lumpView(file, header, ENTITY, entities) ||
+        !lumpView(file, header, SHADER, rawShaders) ||
+        !lumpView(file, header, PLANE, planes) ||
+        !lumpView(file, header, NODE, nodes) ||
+        !lumpView(file, header, LEAF, leaves) ||
+        !lumpView(file, header, LEAFFACE, leafFaces) ||
+        !lumpView(file, header, LEAFBRUSH, leafBrushes) ||
+        !lumpView(file, header, MODEL, models) ||
+        !lumpView(file, header, BRUSH, brushes) ||
+        !lumpView(file, header, BRUSHSIDE, brushSides) ||
+        !lumpView(file, header, VERTEX, vertices) ||
+        !lumpView(file, header, MESHVERTEX, meshVertices) ||
+        !lumpView(file, header, EFFECT, effects) ||
+        !lumpView(file, header, FACE, rawFaces) ||
+        !lumpView(file, header, LIGHTMAP, lightMaps) ||
+        !lumpView(file, header, LIGHTVOL, rawLightVols) ||
+        !lumpView(file, header, VISDATA, visHeader))
+    {
+        std::cout << "Invalid file" << std::endl;
+        return false;
+    }
+    if (models.empty())
+    {
+        std::cout << "Invalid file" << std::endl;
+        return false;
+    }
 
-    int shaderCount = header.lumps[SHADER].size / sizeof(RawShader);
-    PHYSFS_seek(file, header.lumps[SHADER].offset);
-    shaderArray.reserve(shaderCount);
-    for (int i = 0; i < shaderCount; i++)
+    ArrayView<unsigned char> rawVisData;
+    unsigned long int visSize = 0;
+    visData.clusterCount = 0;
+    visData.bytesPerCluster = 0;
+    visData.wordsPerCluster = 0;
+    visData.words.clear();
+    if (visHeader.size() >= 2)
     {
-        RawShader rawshader;
-        PHYSFS_read(file, &rawshader, sizeof(RawShader), 1);
-        rawshader.name[63] = '\0';
-        Shader shader;
-        shader.render = true;
-        shader.transparent = false;
-        shader.solid = true;
-        shader.name = std::string(rawshader.name);
-        if (rawshader.surface & SURF_NONSOLID) shader.solid = false;
-        if (rawshader.contents & CONTENTS_PLAYERCLIP) shader.solid = true;
-        if (rawshader.contents & CONTENTS_TRANSLUCENT) shader.transparent = true;
-        if (rawshader.contents & CONTENTS_LAVA) shader.render = false;
-        if (rawshader.contents & CONTENTS_SLIME) shader.render = false;
-        if (rawshader.contents & CONTENTS_WATER) shader.render = false;
-        if (rawshader.contents & CONTENTS_FOG) shader.render = false;
-        if (shader.name == "noshader") shader.render = false;
-        if (shader.render)
-        {
-            if (PHYSFS_exists(std::string(shader.name + ".jpg").c_str()))
-            {
-                shader.name += ".jpg";
-            }
-            else if (PHYSFS_exists(std::string(shader.name + ".tga").c_str()))
+        visData.clusterCount = visHeader[0];
+        visData.bytesPerCluster = visHeader[1];
+        visSize = (unsigned long int)visData.clusterCount * visData.bytesPerCluster;
+        if (visData.clusterCount < 0 || visData.bytesPerCluster < 0 ||
+            !file.view(header.lumps[VISDATA].offset + 2 * sizeof(int), visSize, rawVisData) ||
+            rawVisData.size() != visSize)
+        {
+            std::cout << "Invalid file" << std::endl;
+            return false;
+        }
+    }
+
+    std::string rawEntity(entities.begin(), entities.end());
+
+    int shaderCount = rawShaders.size();
+    int lightMapCount = lightMaps.size() / (128 * 128 * 3);
+    int faceCount = rawFaces.size();
+    int vertexCount = vertices.size();
+    int meshVertexCount = meshVertices.size();
+    int bezierCount = 0;
+    int bezierPatchSize = (bezierLevel + 1) * (bezierLevel + 1);
+    int bezierIndexSize = bezierLevel * bezierLevel * 6;
+    std::vector<int> bezierVertexOffset(faceCount);
+    std::vector<int> lightMapTile(faceCount);
+
+    GLint maxTextureSize = 4096;
+    if (!headless)
+        glGetIntegerv(GL_MAX_TEXTURE_SIZE, &maxTextureSize);
+    LightMapAtlas atlas(lightMapCount + 1, std::min(maxTextureSize, 4096));
+    std::vector<std::vector<unsigned char> > atlasPixels(atlas.count);
+    for (int i = 0; i < atlas.count; i++)
+        atlasPixels[i].resize(atlas.size * atlas.size * 4);
+
+    // Everything except the GL uploads runs on the job system. Tasks only
+    // touch the arrays they fill, the dependencies order the rest.
+    JobSystem& jobs = JobSystem::instance();
+    int chunkCount = jobs.workerCount() + 1;
+    TaskGraph graph(jobs);
+
+    shaderArray.resize(shaderCount);
+    TaskGraph::Task shaderTask = graph.add([&] {
+        for (int i = 0; i < shaderCount; i++)
+        {
+            RawShader rawshader = rawShaders[i];
+            rawshader.name[63] = '\0';
+            Shader& shader = shaderArray[i];
+            shader.render = true;
+            shader.transparent = false;
+            shader.solid = true;
+            shader.texture = 0;
+            shader.name = std::string(rawshader.name);
+            shader.surface = rawshader.surface;
+            shader.contents = rawshader.contents;
+            if (rawshader.surface & SURF_NONSOLID) shader.solid = false;
+            if (rawshader.contents & CONTENTS_PLAYERCLIP) shader.solid = true;
+            if (rawshader.contents & CONTENTS_TRANSLUCENT) shader.transparent = true;
+            if (rawshader.contents & CONTENTS_LAVA) shader.render = false;
+            if (rawshader.contents & CONTENTS_SLIME) shader.render = false;
+            if (rawshader.contents & CONTENTS_WATER) shader.render = false;
+            if (rawshader.contents & CONTENTS_FOG) shader.render = false;
+            if (shader.name == "noshader") shader.render = false;
+            if (shader.render && fileIndex)
             {
-                shader.name += ".tga";
+                static const char* const extensions[] = { ".jpg", ".tga" };
+                const FileIndex::Entry* entry = fileIndex->resolve(shader.name, extensions, 2);
+                if (entry)
+                    shader.name = entry->path;
             }
-            if ((rawshader.surface & 0x80) == 0)
+            else if (shader.render)
             {
-                FileStream filestream(shader.name);
-                if (filestream.isOpen())
+                if (PHYSFS_exists(std::string(shader.name + ".jpg").c_str()))
                 {
-                    if (shader.texture.loadFromStream(filestream))
-                    {
-                        shader.render = true;
-#if SFML_VERSION_MAJOR > 2 || (SFML_VERSION_MAJOR == 2 && SFML_VERSION_MINOR >= 4)
-                        shader.texture.generateMipmap();
-#endif
-                        shader.texture.setRepeated(true);
-                        shader.texture.setSmooth(true);
-                    }
+                    shader.name += ".jpg";
                 }
-                else
+                else if (PHYSFS_exists(std::string(shader.name + ".tga").c_str()))
                 {
-                    std::cout << shader.name << ": Texture not found" << std::endl;
+                    shader.name += ".tga";
                 }
             }
         }
-        shaderArray.push_back(shader);
-    }
-
-    int planeCount = header.lumps[PLANE].size / sizeof(Plane);
-    PHYSFS_seek(file, header.lumps[PLANE].offset);
-    planeArray.resize(planeCount);
-    if (planeCount > 0)
-        PHYSFS_read(file, &planeArray[0], sizeof(Plane), planeCount);
-
-    int nodeCount = header.lumps[NODE].size / sizeof(Node);
-    PHYSFS_seek(file, header.lumps[NODE].offset);
-    nodeArray.resize(nodeCount);
-    if (nodeCount > 0)
-        PHYSFS_read(file, &nodeArray[0], sizeof(Node), nodeCount);
-
-    int leafCount = header.lumps[LEAF].size / sizeof(Leaf);
-    PHYSFS_seek(file, header.lumps[LEAF].offset);
-    leafArray.resize(leafCount);
-    if (leafCount > 0)
-        PHYSFS_read(file, &leafArray[0], sizeof(Leaf), leafCount);
-
-    int leafFaceCount = header.lumps[LEAFFACE].size / sizeof(int);
-    PHYSFS_seek(file, header.lumps[LEAFFACE].offset);
-    leafFaceArray.resize(leafFaceCount);
-    if (leafFaceCount > 0)
-        PHYSFS_read(file, &leafFaceArray[0], sizeof(int), leafFaceCount);
-
-    int leafBrushCount = header.lumps[LEAFBRUSH].size / sizeof(int);
-    PHYSFS_seek(file, header.lumps[LEAFBRUSH].offset);
-    leafBrushArray.resize(leafBrushCount);
-    if (leafBrushCount > 0)
-        PHYSFS_read(file, &leafBrushArray[0], sizeof(int), leafBrushCount);
-
-    int modelCount = header.lumps[MODEL].size / sizeof(Model);
-    PHYSFS_seek(file, header.lumps[MODEL].offset);
-    modelArray.resize(modelCount);
-    if (modelCount > 0)
-        PHYSFS_read(file, &modelArray[0], sizeof(Model), modelCount);
-
-    int brushCount = header.lumps[BRUSH].size / sizeof(Brush);
-    PHYSFS_seek(file, header.lumps[BRUSH].offset);
-    brushArray.resize(brushCount);
-    if (brushCount > 0)
-        PHYSFS_read(file, &brushArray[0], sizeof(Brush), brushCount);
-
-    int brushSideCount = header.lumps[BRUSHSIDE].size / sizeof(BrushSide);
-    PHYSFS_seek(file, header.lumps[BRUSHSIDE].offset);
-    brushSideArray.resize(brushSideCount);
-    if (brushSideCount > 0)
-        PHYSFS_read(file, &brushSideArray[0], sizeof(BrushSide), brushSideCount);
-
-    int effectCount = header.lumps[EFFECT].size / sizeof(Effect);
-    PHYSFS_seek(file, header.lumps[EFFECT].offset);
-    effectArray.resize(effectCount);
-    if (effectCount > 0)
-        PHYSFS_read(file, &effectArray[0], sizeof(Effect), effectCount);
-
-    int lightMapCount = header.lumps[LIGHTMAP].size / (128 * 128 * 3);
-    PHYSFS_seek(file, header.lumps[LIGHTMAP].offset);
-    lightMapArray.resize(lightMapCount + 1);
-    for (int i = 0; i < lightMapCount; i++)
-    {
-        std::array<sf::Uint8, 128 * 128 * 4> rawLightMap;
-        for (int i = 0; i < 128 * 128; i++)
-        {
-            PHYSFS_read(file, &rawLightMap[i * 4], 3, 1);
-            rawLightMap[i * 4 + 3] = 255;
-        }
-        sf::Image image;
-        image.create(128, 128, &rawLightMap[0]);
-        sf::Texture &texture = lightMapArray[i];
-        texture.loadFromImage(image);
-        texture.setRepeated(true);
-        texture.setSmooth(true);
-    }
-    {
-        sf::Image image;
-        image.create(1, 1, sf::Color(85, 85, 85));
-        lightMapArray[lightMapCount].loadFromImage(image);
-    }
-
-    int faceCount = header.lumps[FACE].size / sizeof(RawFace);
-    int bezierCount = 0;
-    int bezierPatchSize = (bezierLevel + 1) * (bezierLevel + 1);
-    int bezierIndexSize = bezierLevel * bezierLevel * 6;
-    PHYSFS_seek(file, header.lumps[FACE].offset);
-    faceArray.resize(faceCount);
-    for (int i = 0; i < faceCount; i++)
-    {
-        RawFace rawFace;
-        PHYSFS_read(file, &rawFace, sizeof(RawFace), 1);
-        Face &face = faceArray[i];
-        face.shader = rawFace.shader;
-        face.effect = rawFace.effect;
-        face.vertexOffset = rawFace.vertexOffset;
-        face.vertexCount = rawFace.vertexCount;
-        face.meshIndexOffset = rawFace.meshVertexOffset;
-        face.meshIndexCount = rawFace.meshVertexCount;
-        face.lightMap = rawFace.lightMap;
-        if (rawFace.lightMap < 0)
-            face.lightMap = lightMapCount;
-        switch (rawFace.type)
-        {
-        case 1:
-            face.type = Face::Brush;
-            break;
-        case 2:
-            face.type = Face::Bezier;
-            break;
-        case 3:
-            face.type = Face::Model;
-            break;
-        default:
-            face.type = Face::None;
-            break;
-        }
+    });
+
+    graph.add([&] { planeArray.assign(planes.begin(), planes.end()); });
+    graph.add([&] { nodeArray.assign(nodes.begin(), nodes.end()); });
+    graph.add([&] { leafArray.assign(leaves.begin(), leaves.end()); });
+    graph.add([&] { leafFaceArray.assign(leafFaces.begin(), leafFaces.end()); });
+    graph.add([&] { leafBrushArray.assign(leafBrushes.begin(), leafBrushes.end()); });
+    graph.add([&] { modelArray.assign(models.begin(), models.end()); });
+    graph.add([&] { brushArray.assign(brushes.begin(), brushes.end()); });
+    graph.add([&] { brushSideArray.assign(brushSides.begin(), brushSides.end()); });
+    graph.add([&] { effectArray.assign(effects.begin(), effects.end()); });
+
+    for (int chunk = 0; chunk < chunkCount; chunk++)
+    {
+        int first = lightMapCount * chunk / chunkCount;
+        int last = lightMapCount * (chunk + 1) / chunkCount;
+        if (chunk == chunkCount - 1)
+            last++;
+        graph.add([&, first, last] {
+            for (int tile = first; tile < last; tile++)
+            {
+                int index, x, y;
+                atlas.place(tile, index, x, y);
+                for (int row = 0; row < 128; row++)
+                {
+                    unsigned char* dst = &atlasPixels[index][((y + row) * atlas.size + x) * 4];
+                    if (tile == lightMapCount)
+                    {
+                        for (int i = 0; i < 128; i++)
+                        {
+                            dst[i * 4 + 0] = 85;
+                            dst[i * 4 + 1] = 85;
+                            dst[i * 4 + 2] = 85;
+                            dst[i * 4 + 3] = 255;
+                        }
+                        continue;
+                    }
 
-        if (face.type == Face::Bezier)
-        {
-            face.bezierSize[0] = rawFace.size[0];
-            face.bezierSize[1] = rawFace.size[1];
-            int dimX = (face.bezierSize[0] - 1) / 2;
-            int dimY = (face.bezierSize[0] - 1) / 2;
-            int size = dimX * dimY;
-            bezierCount += size;
-        }
+                    const unsigned char* src = &lightMaps[(tile * 128 * 128 + row * 128) * 3];
+                    for (int i = 0; i < 128; i++)
+                    {
+                        dst[i * 4 + 0] = src[i * 3 + 0];
+                        dst[i * 4 + 1] = src[i * 3 + 1];
+                        dst[i * 4 + 2] = src[i * 3 + 2];
+                        dst[i * 4 + 3] = 255;
+                    }
+                }
+            }
+        });
     }
 
-    int meshVertexCount = header.lumps[MESHVERTEX].size / sizeof(GLuint);
-    PHYSFS_seek(file, header.lumps[MESHVERTEX].offset);
-    meshIndexArray.resize(meshVertexCount + bezierIndexSize * bezierCount);
-    if (meshVertexCount > 0)
-        PHYSFS_read(file, &meshIndexArray[0], sizeof(GLuint), meshVertexCount);
-
-    int vertexCount = header.lumps[VERTEX].size / sizeof(Vertex);
-    PHYSFS_seek(file, header.lumps[VERTEX].offset);
-    vertexArray.resize(vertexCount + bezierCount * bezierPatchSize);
-    if (vertexCount > 0)
-        PHYSFS_read(file, &vertexArray[0], sizeof(Vertex), vertexCount);
-
-    for (int i = 0, vOffset = vertexCount, iOffset = meshVertexCount; i < faceCount; i++)
+    // A valid precompiled cache replaces the face conversion, tessellation
+    // and light grid decoding with bulk copies.
+    mapFileName = filename;
+    MapCache cache(cacheDir, filename, file.size(), PHYSFS_getLastModTime(filename.c_str()), bezierLevel, atlas.size);
+    bool cached = !cacheDir.empty() && cache.open();
+    if (cached)
     {
-        Face &face = faceArray[i];
-        if (face.type == Face::Bezier)
-        {
-            int dimX = (face.bezierSize[0] - 1) / 2;
-            int dimY = (face.bezierSize[1] - 1) / 2;
+        graph.add([&] { faceArray.assign(cache.faces.begin(), cache.faces.end()); });
+        graph.add([&] { vertexArray.assign(cache.vertices.begin(), cache.vertices.end()); });
+        graph.add([&] { meshIndexArray.assign(cache.meshIndices.begin(), cache.meshIndices.end()); });
+        graph.add([&] { lightVolArray.assign(cache.lightVols.begin(), cache.lightVols.end()); });
+    }
+    else
+    {
+        TaskGraph::Task faceTask = graph.add([&] {
+            faceArray.resize(faceCount);
+            int iOffset = meshVertexCount;
+            for (int i = 0; i < faceCount; i++)
+            {
+                const RawFace& rawFace = rawFaces[i];
+                Face &face = faceArray[i];
+                face.shader = rawFace.shader;
+                face.effect = rawFace.effect;
+                face.vertexOffset = rawFace.vertexOffset;
+                face.vertexCount = rawFace.vertexCount;
+                face.meshIndexOffset = rawFace.meshVertexOffset;
+                face.meshIndexCount = rawFace.meshVertexCount;
+                int tile = rawFace.lightMap;
+                if (tile < 0 || tile >= lightMapCount)
+                    tile = lightMapCount;
+                int x, y;
+                atlas.place(tile, face.lightMap, x, y);
+                lightMapTile[i] = tile;
+                switch (rawFace.type)
+                {
+                case 1:
+                    face.type = Face::Brush;
+                    break;
+                case 2:
+                    face.type = Face::Bezier;
+                    break;
+                case 3:
+                    face.type = Face::Model;
+                    break;
+                default:
+                    face.type = Face::None;
+                    break;
+                }
 
-            face.meshIndexOffset = iOffset;
+                if (face.type == Face::Bezier)
+                {
+                    face.bezierSize[0] = rawFace.size[0];
+                    face.bezierSize[1] = rawFace.size[1];
+                    int dimX = (face.bezierSize[0] - 1) / 2;
+                    int dimY = (face.bezierSize[1] - 1) / 2;
+                    int size = dimX * dimY;
+
+                    bezierVertexOffset[i] = vertexCount + bezierCount * bezierPatchSize;
+                    face.meshIndexOffset = iOffset;
+                    face.meshIndexCount = size * bezierIndexSize;
+                    iOffset += face.meshIndexCount;
+                    bezierCount += size;
+                }
+            }
+        });
+
+        // Lightmap coordinates are moved into the face's atlas tile before
+        // tessellation, the patches then interpolate the remapped values.
+        TaskGraph::Task vertexTask = graph.add([&] {
+            vertexArray.resize(vertexCount + bezierCount * bezierPatchSize);
+            std::copy(vertices.begin(), vertices.end(), vertexArray.begin());
+            for (int i = 0; i < faceCount; i++)
+            {
+                const Face& face = faceArray[i];
+                if (face.vertexOffset < 0 || face.vertexOffset + face.vertexCount > vertexCount)
+                    continue;
+
+                int index, x, y;
+                atlas.place(lightMapTile[i], index, x, y);
+                glm::vec2 origin(x, y);
+                for (int v = face.vertexOffset; v < face.vertexOffset + face.vertexCount; v++)
+                {
+                    glm::vec2& lmCoord = vertexArray[v].lmCoord;
+                    if (lightMapTile[i] == lightMapCount)
+                        lmCoord = (origin + glm::vec2(64.f, 64.f)) / float(atlas.size);
+                    else
+                        lmCoord = (origin + lmCoord * 128.f) / float(atlas.size);
+                }
+            }
+        }, {faceTask});
 
-            for (int x = 0, n = 0; n < dimX; n++, x = 2 * n)
+        TaskGraph::Task meshIndexTask = graph.add([&] {
+            meshIndexArray.resize(meshVertexCount + bezierIndexSize * bezierCount);
+            std::copy(meshVertices.begin(), meshVertices.end(), meshIndexArray.begin());
+            for (int i = 0; i < faceCount; i++)
             {
-                for (int y = 0, m = 0; m < dimY; m++, y = 2 * m)
+                Face &face = faceArray[i];
+                if (face.type == Face::Bezier)
+                    continue;
+                for (int i = 0; i < face.meshIndexCount; i++)
                 {
-                    tesselate(face.vertexOffset + x + face.bezierSize[0] * y, face.bezierSize[0], vOffset, iOffset);
-                    vOffset += bezierPatchSize;
-                    iOffset += bezierIndexSize;
+                    meshIndexArray[face.meshIndexOffset + i] += face.vertexOffset;
                 }
             }
+        }, {faceTask});
 
-            face.meshIndexCount = iOffset - face.meshIndexOffset;
-        }
-        else
+        for (int chunk = 0; chunk < chunkCount; chunk++)
         {
-            for (int i = 0; i < face.meshIndexCount; i++)
+            int first = faceCount * chunk / chunkCount;
+            int last = faceCount * (chunk + 1) / chunkCount;
+            graph.add([&, first, last] {
+                for (int i = first; i < last; i++)
+                {
+                    Face &face = faceArray[i];
+                    if (face.type != Face::Bezier)
+                        continue;
+
+                    int dimX = (face.bezierSize[0] - 1) / 2;
+                    int dimY = (face.bezierSize[1] - 1) / 2;
+                    int vOffset = bezierVertexOffset[i];
+                    int iOffset = face.meshIndexOffset;
+
+                    for (int x = 0, n = 0; n < dimX; n++, x = 2 * n)
+                    {
+                        for (int y = 0, m = 0; m < dimY; m++, y = 2 * m)
+                        {
+                            tesselate(face.vertexOffset + x + face.bezierSize[0] * y, face.bezierSize[0], vOffset, iOffset);
+                            vOffset += bezierPatchSize;
+                            iOffset += bezierIndexSize;
+                        }
+                    }
+                }
+            }, {faceTask, vertexTask, meshIndexTask});
+        }
+
+        graph.add([&] {
+            int lightVolCount = rawLightVols.size();
+            lightVolArray.resize(lightVolCount);
+            for (int i = 0; i < lightVolCount; i++)
             {
-                meshIndexArray[face.meshIndexOffset + i] += face.vertexOffset;
+                const RawLightVol& rawLightVol = rawLightVols[i];
+                LightVol& lightVol = lightVolArray[i];
+
+                lightVol.ambient.x = rawLightVol.ambient[0];
+                lightVol.ambient.y = rawLightVol.ambient[1];
+                lightVol.ambient.z = rawLightVol.ambient[2];
+                lightVol.ambient = lightVol.ambient / 256.f;
+
+                lightVol.directional.x = rawLightVol.directional[0];
+                lightVol.directional.y = rawLightVol.directional[1];
+                lightVol.directional.z = rawLightVol.directional[2];
+                lightVol.directional = lightVol.directional / 256.f;
+
+                float phi = (int(rawLightVol.direction[0]) - 128) / 256.f * 180;
+                float thetha = int(rawLightVol.direction[1]) / 256.f * 360;
+
+                lightVol.direction.x = sin(thetha) * cos(phi);
+                lightVol.direction.y = cos(thetha) * cos(phi);
+                lightVol.direction.z = sin(phi);
+                lightVol.direction = glm::normalize(lightVol.direction);
             }
-        }
+        });
     }
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBufferData(GL_ARRAY_BUFFER, vertexArray.size() * sizeof(Vertex), &vertexArray[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ARRAY_BUFFER, 0);
 
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
-    glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshIndexArray.size() * sizeof(GLuint), &meshIndexArray[0], GL_STATIC_DRAW);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+    if (visHeader.size() >= 2)
+    {
+        graph.add([&] {
+            // Bytes are packed little endian into words so bit n of a row
+            // stays bit n of the word array.
+            int bytes = visData.bytesPerCluster;
+            visData.wordsPerCluster = (bytes + 7) / 8;
+            visData.words.assign((size_t)visData.clusterCount * visData.wordsPerCluster, 0);
+            for (int row = 0; row < visData.clusterCount; row++)
+            {
+                uint64_t* words = &visData.words[(size_t)row * visData.wordsPerCluster];
+                for (int i = 0; i < bytes; i++)
+                    words[i / 8] |= (uint64_t)rawVisData[(size_t)row * bytes + i] << ((i % 8) * 8);
+            }
+        });
+    }
 
-    int lightVolCount = header.lumps[LIGHTVOL].size / sizeof(RawLightVol);
-    PHYSFS_seek(file, header.lumps[LIGHTVOL].offset);
-    lightVolArray.reserve(lightVolCount);
-    for (int i = 0; i < lightVolCount; i++)
+    // Image decoding and mip generation for each texture is its own task,
+    // only the upload needs the GL context.
+    textureCache.resetCounters();
+    std::vector<TextureData> textureData(shaderCount);
+    std::vector<char> textureMissing(shaderCount, false);
+    std::vector<TaskGraph::Task> textureTasks(shaderCount);
+    for (int i = 0; i < shaderCount; i++)
     {
-        RawLightVol rawLightVol;
-        PHYSFS_read(file, &rawLightVol, sizeof(RawLightVol), 1);
-        LightVol lightVol;
+        textureTasks[i] = graph.add([&, i] {
+            Shader& shader = shaderArray[i];
+            if (headless || !shader.render || (shader.surface & SURF_NODRAW) != 0)
+                return;
+
+            if (textureCache.load(shader.name, textureData[i]))
+                return;
+
+            // Indexed files are read from the archive they were found in
+            // without going through the search path again
+            const FileIndex::Entry* entry = fileIndex ? fileIndex->find(shader.name) : NULL;
+            std::vector<char> file;
+            if (entry && fileIndex->read(*entry, file))
+            {
+                if (decodeTexture(file, textureData[i]))
+                    textureCache.store(shader.name, textureData[i]);
+                return;
+            }
+
+            FileStream filestream(shader.name);
+            if (filestream.isOpen())
+            {
+                if (decodeTexture(filestream, textureData[i]))
+                    textureCache.store(shader.name, textureData[i]);
+            }
+            else
+            {
+                textureMissing[i] = true;
+            }
+        }, {shaderTask});
+    }
 
-        lightVol.ambient.x = rawLightVol.ambient[0];
-        lightVol.ambient.y = rawLightVol.ambient[1];
-        lightVol.ambient.z = rawLightVol.ambient[2];
-        lightVol.ambient = lightVol.ambient / 256.f;
+    graph.start();
 
-        lightVol.directional.x = rawLightVol.directional[0];
-        lightVol.directional.y = rawLightVol.directional[1];
-        lightVol.directional.z = rawLightVol.directional[2];
-        lightVol.directional = lightVol.directional / 256.f;
+    for (int i = 0; i < shaderCount; i++)
+    {
+        graph.wait(textureTasks[i]);
+        if (textureMissing[i])
+            std::cout << shaderArray[i].name << ": Texture not found" << std::endl;
+        if (!headless)
+            shaderArray[i].texture = uploadTexture(textureData[i]);
+        textureData[i] = TextureData();
+    }
 
-        float phi = (int(rawLightVol.direction[0]) - 128) / 256.f * 180;
-        float thetha = int(rawLightVol.direction[1]) / 256.f * 360;
+    graph.wait();
 
-        lightVol.direction.x = sin(thetha) * cos(phi);
-        lightVol.direction.y = cos(thetha) * cos(phi);
-        lightVol.direction.z = sin(phi);
-        lightVol.direction = glm::normalize(lightVol.direction);
+    // The visible set covers every cluster a leaf refers to, even when the
+    // vis data is missing or shorter.
+    int clusterCount = visData.clusterCount;
+    for (size_t i = 0; i < leafArray.size(); i++)
+        clusterCount = std::max(clusterCount, leafArray[i].cluster + 1);
+    visibleClusters.assign((clusterCount + 63) / 64, 0);
 
-        lightVolArray.push_back(lightVol);
-    }
+    faceStampArray.assign(faceArray.size(), 0);
+    brushStampArray.assign(brushArray.size(), 0);
+    faceGeneration = 0;
+    brushGeneration = 0;
 
-    PHYSFS_seek(file, header.lumps[VISDATA].offset);
-    if (header.lumps[VISDATA].size > 0)
+    brushBounds.resize(brushArray.size());
+    for (size_t i = 0; i < brushArray.size(); i++)
     {
-        PHYSFS_read(file, &visData.clusterCount, sizeof(int), 1);
-        PHYSFS_read(file, &visData.bytesPerCluster, sizeof(int), 1);
-        unsigned int size = visData.clusterCount * visData.bytesPerCluster;
-        std::vector<char> rawVisData(size);
-        PHYSFS_read(file, &rawVisData[0], size, 1);
-
-        visData.data.resize(size * 8, false);
-        for (unsigned long int byteIndex = 0; byteIndex < size; byteIndex++)
+        const Brush& brush = brushArray[i];
+        glm::vec3 min(-std::numeric_limits<float>::max());
+        glm::vec3 max(std::numeric_limits<float>::max());
+        for (int j = 0; j < brush.sideCount; j++)
         {
-            unsigned char byte = rawVisData.at(byteIndex);
-            for (unsigned int bit = 0; bit < 8; bit++)
+            const Plane& plane = planeArray[brushSideArray[brush.sideOffset + j].plane];
+            for (int axis = 0; axis < 3; axis++)
             {
-                if (byte & (1 << bit))
-                    visData.data[byteIndex * 8 + bit] = true;
+                if (plane.normal[axis] == 1.f)
+                    max[axis] = std::min(max[axis], plane.distance);
+                else if (plane.normal[axis] == -1.f)
+                    min[axis] = std::max(min[axis], -plane.distance);
             }
         }
+        brushBounds.set(i, min, max);
     }
 
-    PHYSFS_close(file);
-
-    lightVolSizeX = int(floor(modelArray[0].max.x / 64) - ceil(modelArray[0].min.x / 64) + 1);
-    lightVolSizeY = int(floor(modelArray[0].max.y / 64) - ceil(modelArray[0].min.y / 64) + 1);
-    lightVolSizeZ = int(floor(modelArray[0].max.z / 128) - ceil(modelArray[0].min.z / 128) + 1);
-
-    glDisable(GL_TEXTURE_2D);
-    return true;
-}
-
-bool Map::clusterVisible(int test, int cam)
-{
-    if (visData.data.size() == 0 || cam < 0 || test < 0)
-        return true;
-
-    return visData.data[test * visData.bytesPerCluster * 8 + cam];
-}
-
-int Map::findLeaf(glm::vec3& pos)
-{
-    int index = 0;
-    while (index >= 0)
+    faceBounds.resize(faceArray.size());
+    faceCentroidArray.resize(faceArray.size());
+    facePlaneArray.resize(faceArray.size());
+    for (size_t i = 0; i < faceArray.size(); i++)
     {
-        Node& node = nodeArray[index];
-        Plane& plane = planeArray[node.plane];
-        if (glm::dot(plane.normal, pos) >= plane.distance)
+        const Face& face = faceArray[i];
+        updateFaceBounds(i);
+
+        // The face normal is only set for brush faces. Transparent ones are
+        // drawn from both sides.
+        Plane& plane = facePlaneArray[i];
+        plane.normal = glm::vec3(0.f);
+        plane.distance = 0.f;
+        if (face.type == Face::Brush && face.meshIndexCount > 0 && i < rawFaces.size() &&
+            !shaderArray[face.shader].transparent)
         {
-            index = node.children[0];
+            plane.normal = rawFaces[i].normal;
+            plane.distance = glm::dot(plane.normal, faceCentroidArray[i]);
         }
-        else
+    }
+
+    occluderArray.clear();
+    for (size_t i = 0; i < faceArray.size(); i++)
+    {
+        const Face& face = faceArray[i];
+        const glm::vec3& normal = facePlaneArray[i].normal;
+        if (glm::dot(normal, normal) == 0.f || !shaderArray[face.shader].render ||
+            face.vertexCount < 3 || face.vertexCount >= OcclusionBuffer::MaxCorners)
         {
-            index = node.children[1];
+            continue;
         }
-    };
-    return ~index;
-}
 
-LightVol Map::findLightVol(glm::vec3& pos)
-{
-    if (lightVolArray.size() == 0)
-        return LightVol();
-    int cellX = int(floor(pos.x / 64) - ceil(modelArray[0].min.x / 64));
-    int cellY = int(floor(pos.y / 64) - ceil(modelArray[0].min.y / 64));
-    int cellZ = int(floor(pos.z / 128) - ceil(modelArray[0].min.z / 128));
-    cellX = std::min(std::max(cellX, 0), (int)lightVolSizeX);
-    cellY = std::min(std::max(cellY, 0), (int)lightVolSizeY);
-    cellZ = std::min(std::max(cellZ, 0), (int)lightVolSizeZ);
-    unsigned int index = cellX;
-    index += cellY * lightVolSizeX;
-    index += cellZ * lightVolSizeX * lightVolSizeY;
-    return lightVolArray[index];
-}
+        // The vertex loop is drawn as one convex polygon, which only matches
+        // what the face covers when the loop turns the same way at every
+        // corner and the mesh triangles fill all of it. Merged surfaces may
+        // be concave or have holes, such as a wall with a window.
+        const Vertex* loop = &vertexArray[face.vertexOffset];
+        int count = face.vertexCount;
+        float winding = 0.f;
+        bool convex = true;
+        for (int j = 0; j < count && convex; j++)
+        {
+            glm::vec3 edge = loop[(j + 1) % count].position - loop[j].position;
+            glm::vec3 next = loop[(j + 2) % count].position - loop[(j + 1) % count].position;
+            float turn = glm::dot(glm::cross(edge, next), normal);
+            // Corners in a straight line don't change the shape
+            if (std::fabs(turn) <= CONVEX_EPSILON * glm::length(edge) * glm::length(next))
+                continue;
+            if (winding == 0.f)
+                winding = turn;
+            convex = (turn > 0.f) == (winding > 0.f);
+        }
+        if (!convex)
+            continue;
 
-void Map::renderFace(int index, RenderPass& pass, bool solid)
-{
-    if (pass.renderedFaces[index])
-        return;
-    Face& face = faceArray[index];
-    if (shaderArray[face.shader].transparent == solid)
-        return;
-    if (!shaderArray[face.shader].render)
-        return;
+        glm::vec3 sum(0.f);
+        for (int j = 1; j + 1 < count; j++)
+            sum += glm::cross(loop[j].position - loop[0].position, loop[j + 1].position - loop[0].position);
+        float loopArea = std::fabs(glm::dot(sum, normal)) * 0.5f;
+        float meshArea = 0.f;
+        for (int j = 0; j + 2 < face.meshIndexCount; j += 3)
+        {
+            const glm::vec3& a = vertexArray[meshIndexArray[face.meshIndexOffset + j]].position;
+            const glm::vec3& b = vertexArray[meshIndexArray[face.meshIndexOffset + j + 1]].position;
+            const glm::vec3& c = vertexArray[meshIndexArray[face.meshIndexOffset + j + 2]].position;
+            meshArea += glm::length(glm::cross(b - a, c - a)) * 0.5f;
+        }
+        if (std::fabs(loopArea - meshArea) > OCCLUDER_AREA_TOLERANCE * loopArea)
+            continue;
 
-    glActiveTexture(GL_TEXTURE0);
-    sf::Texture::bind(&shaderArray[face.shader].texture);
-    glActiveTexture(GL_TEXTURE1);
-    sf::Texture::bind(&lightMapArray[face.lightMap]);
+        Occluder occluder;
+        occluder.face = i;
+        occluder.area = meshArea;
+        if (occluder.area >= OCCLUDER_MIN_AREA)
+            occluderArray.push_back(occluder);
+    }
 
-    glDrawElements(GL_TRIANGLES, face.meshIndexCount, GL_UNSIGNED_INT, (void*)(long)(face.meshIndexOffset * sizeof(GLuint)));
+    // Renumber the nodes depth first, front child before back, so walks
+    // mostly move forward through memory. Nodes the root can't reach are
+    // dropped.
+    if (!nodeArray.empty())
+    {
+        std::vector<int> order;
+        std::vector<int> renumber;
+        depthFirstNodes(nodeArray, order, renumber);
 
-    pass.renderedFaces[index] = true;
-}
+        std::vector<Node> sorted(order.size());
+        for (size_t i = 0; i < order.size(); i++)
+        {
+            sorted[i] = nodeArray[order[i]];
+            for (int j = 0; j < 2; j++)
+            {
+                int& child = sorted[i].children[j];
+                if (child >= 0)
+                    child = child < (int)renumber.size() ? renumber[child] : -1;
+            }
+        }
+        nodeArray.swap(sorted);
+    }
 
-void Map::renderNode(int index, RenderPass& pass, bool solid)
-{
-    if (index < 0)
+    compactNodeArray.resize(nodeArray.size());
+    for (size_t i = 0; i < nodeArray.size(); i++)
     {
-        Leaf& leaf = leafArray[~index];
-        if (!clusterVisible(leaf.cluster, pass.cluster))
-            return;
-        if (!pass.frutsum.insideAABB(leaf.max, leaf.min))
-            return;
+        const Node& node = nodeArray[i];
+        CompactNode& compact = compactNodeArray[i];
+        compact.normal = planeArray[node.plane].normal;
+        compact.distance = planeArray[node.plane].distance;
+        compact.children[0] = node.children[0];
+        compact.children[1] = node.children[1];
+        compact.parent = -1;
+        compact.plane = node.plane;
+    }
 
-        for (int i = 0; i < leaf.faceCount; i++)
+    nodeBounds.resize(nodeArray.size());
+    for (size_t i = 0; i < nodeArray.size(); i++)
+        nodeBounds.set(i, nodeArray[i].min, nodeArray[i].max);
+    leafBounds.resize(leafArray.size());
+    for (size_t i = 0; i < leafArray.size(); i++)
+        leafBounds.set(i, leafArray[i].min, leafArray[i].max);
+    faceInsideArray.assign(faceBounds.size(), 0);
+    faceCache.clear();
+    faceCache.resetCounters();
+    lastLeaf = -1;
+
+    leafParentArray.assign(leafArray.size(), -1);
+    nodeVisFrameArray.assign(nodeArray.size(), 0);
+    visFrame = 0;
+    for (size_t i = 0; i < nodeArray.size(); i++)
+    {
+        for (int j = 0; j < 2; j++)
         {
-            int faceIndex = leafFaceArray[i + leaf.faceOffset];
-            renderFace(faceIndex, pass, solid);
+            int child = nodeArray[i].children[j];
+            if (child >= 0)
+                compactNodeArray[child].parent = i;
+            else
+                leafParentArray[~child] = i;
         }
-        return;
     }
+    // No cluster is -2, the first frame always decodes its row
+    visCluster = -2;
 
-    Node& node = nodeArray[index];
-    if (!pass.frutsum.insideAABB(node.max, node.min))
-        return;
+    entityArray.clear();
+    if (!parseEntities(rawEntity, entityArray))
+        std::cout << filename << ": Invalid entity lump" << std::endl;
+    findAreaPortals();
+    findInstances();
 
-    Plane& plane = planeArray[node.plane];
+    if (textureCache.enabled())
+    {
+        std::cout << "Texture cache: " << textureCache.hits() << " hits, "
+                  << textureCache.misses() << " misses" << std::endl;
+    }
 
-    if ((glm::dot(plane.normal, pass.pos) >= plane.distance) == solid)
+    lightMapArray.assign(atlas.count, 0);
+    for (int i = 0; i < atlas.count && !headless; i++)
     {
-        renderNode(node.children[0], pass, solid);
-        renderNode(node.children[1], pass, solid);
+        TextureData data;
+        createTexture(atlas.size, atlas.size, &atlasPixels[i][0], data);
+        lightMapArray[i] = uploadTexture(data);
     }
-    else
+
+    if (!cacheDir.empty() && !cached)
     {
-        renderNode(node.children[1], pass, solid);
-        renderNode(node.children[0], pass, solid);
+        if (!cache.write(vertexArray, meshIndexArray, faceArray, lightVolArray))
+            std::cout << filename << ": Unable to write map cache" << std::endl;
     }
-}
 
-void Map::renderWorld(glm::mat4 matrix, glm::vec3 pos)
-{
-    glFrontFace(GL_CW);
-    glEnable(GL_TEXTURE_2D);
-    glEnable(GL_DEPTH_TEST);
-    glDepthFunc(GL_LEQUAL);
-    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
-    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+    // Doors that start open are moved once the cache holds where they were
+    // compiled
+    for (size_t i = 0; i < instanceArray.size(); i++)
+    {
+        if (instanceArray[i].open)
+            placeInstance(i, glm::translate(glm::mat4(1.f), instanceArray[i].openOffset));
+    }
 
-    if (nodeArray.size() == 0)
-        return;
+    lightVolSizeX = int(floor(modelArray[0].max.x / 64) - ceil(modelArray[0].min.x / 64) + 1);
+    lightVolSizeY = int(floor(modelArray[0].max.y / 64) - ceil(modelArray[0].min.y / 64) + 1);
+    lightVolSizeZ = int(floor(modelArray[0].max.z / 128) - ceil(modelArray[0].min.z / 128) + 1);
 
-    glUseProgram(program);
-    glEnableVertexAttribArray(0);
-    //glEnableVertexAttribArray(1);
-    glEnableVertexAttribArray(2);
-    glEnableVertexAttribArray(3);
-    glUniformMatrix4fv(programLoc["matrix"], 1, GL_FALSE, &matrix[0][0]);
-    glUniform1i(programLoc["texture"], 0);
-    glUniform1i(programLoc["lightmap"], 1);
-    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexPosition);
-    //glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE,  sizeof(Vertex), VertexNormal);
-    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexTexCoord);
-    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexLMCoord);
-
-    RenderPass pass(this, pos, matrix);
-    pass.cluster = leafArray[findLeaf(pos)].cluster;
-
-    glEnable(GL_CULL_FACE);
-    glDisable(GL_BLEND);
-    renderNode(0, pass, true);
-
-    glDisable(GL_CULL_FACE);
-    glEnable(GL_BLEND);
-    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
-    renderNode(0, pass, false);
+    delete indirect;
+    indirect = NULL;
+    useIndirect = false;
+    if (headless)
+        return true;
 
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBufferData(GL_ARRAY_BUFFER, vertexArray.size() * sizeof(Vertex), &vertexArray[0], GL_STATIC_DRAW);
     glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, meshIndexArray.size() * sizeof(GLuint), &meshIndexArray[0], GL_STATIC_DRAW);
     glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+
+    if (IndirectRenderer::supported())
+    {
+        indirect = new IndirectRenderer();
+        if (!indirect->init(vertexBuffer, meshIndexBuffer, shaderArray, lightMapArray, faceArray))
+        {
+            std::cout << "Unable to set up the indirect renderer" << std::endl;
+            delete indirect;
+            indirect = NULL;
+        }
+    }
+    useIndirect = indirect != NULL;
+
     glDisable(GL_TEXTURE_2D);
-    glDisable(GL_DEPTH_TEST);
-    glDisable(GL_BLEND);
+
+    // Texture uploads changed the bindings behind the state cache's back
+    state.invalidate();
+    return true;
 }
 
-void Map::traceBrush(int index, TracePass& pass)
+void Map::updateVisibility(int cluster, int area)
 {
-    if (pass.tracedBrushes[index])
+    if (cluster == visCluster && area == visArea && !areasChanged)
         return;
-    pass.tracedBrushes[index] = true;
+    visCluster = cluster;
+    floodAreas(area);
+
+    // Outside the map or without vis data everything is visible
+    if (cluster < 0 || cluster >= visData.clusterCount)
+    {
+        std::fill(visibleClusters.begin(), visibleClusters.end(), ~(uint64_t)0);
+    }
+    else
+    {
+        const uint64_t* row = &visData.words[(size_t)cluster * visData.wordsPerCluster];
+        size_t words = std::min<size_t>(visData.wordsPerCluster, visibleClusters.size());
+        std::fill(visibleClusters.begin(), visibleClusters.end(), 0);
+        std::copy(row, row + words, visibleClusters.begin());
+    }
+
+    visibleLeafArray.clear();
+    for (size_t i = 0; i < leafArray.size(); i++)
+    {
+        if (leafVisible(leafArray[i]))
+            visibleLeafArray.push_back(i);
+    }
+
+    // Mark the ancestors of every visible leaf that has something to draw,
+    // the walk up stops at the first node already marked.
+    visFrame++;
+    for (size_t i = 0; i < visibleLeafArray.size(); i++)
+    {
+        int leaf = visibleLeafArray[i];
+        if (leafArray[leaf].faceCount == 0)
+            continue;
+        for (int node = leafParentArray[leaf]; node >= 0 && nodeVisFrameArray[node] != visFrame; node = compactNodeArray[node].parent)
+            nodeVisFrameArray[node] = visFrame;
+    }
+}
+
+void Map::floodAreas(int area)
+{
+    visArea = area;
+    areasChanged = false;
+
+    // Outside the map everything is reachable
+    if (area < 0 || area >= areaCount)
+    {
+        std::fill(areaVisibleArray.begin(), areaVisibleArray.end(), 1);
+        return;
+    }
+
+    std::fill(areaVisibleArray.begin(), areaVisibleArray.end(), 0);
+    areaVisibleArray[area] = 1;
+    areaStack.clear();
+    areaStack.push_back(area);
+    while (!areaStack.empty())
+    {
+        int current = areaStack.back();
+        areaStack.pop_back();
+        for (size_t i = 0; i < areaPortalArray.size(); i++)
+        {
+            const AreaPortal& portal = areaPortalArray[i];
+            if (!portal.open)
+                continue;
+            for (int j = 0; j < 2; j++)
+            {
+                int other = portal.areas[j ^ 1];
+                if (portal.areas[j] == current && !areaVisibleArray[other])
+                {
+                    areaVisibleArray[other] = 1;
+                    areaStack.push_back(other);
+                }
+            }
+        }
+    }
+}
+
+bool Map::clusterVisible(int test) const
+{
+    // Leaves without a cluster are inside solid space
+    if (test < 0)
+        return false;
+    return (visibleClusters[test >> 6] >> (test & 63)) & 1;
+}
+
+bool Map::leafVisible(const Leaf& leaf) const
+{
+    // Leaves outside every area are never ruled out by the portals
+    if (!clusterVisible(leaf.cluster))
+        return false;
+    return leaf.area < 0 || leaf.area >= areaCount || areaVisibleArray[leaf.area];
+}
+
+void Map::boxLeaves(const glm::vec3& min, const glm::vec3& max, std::vector<int>& leaves) const
+{
+    glm::vec3 centre = (min + max) * 0.5f;
+    glm::vec3 extent = (max - min) * 0.5f;
+    std::vector<int> stack(1, 0);
+    while (!stack.empty())
+    {
+        int index = stack.back();
+        stack.pop_back();
+        if (index < 0)
+        {
+            leaves.push_back(~index);
+            continue;
+        }
+
+        const CompactNode& node = compactNodeArray[index];
+        float dist = glm::dot(node.normal, centre) - node.distance;
+        float radius = glm::dot(glm::abs(node.normal), extent);
+        if (dist > -radius)
+            stack.push_back(node.children[0]);
+        if (dist < radius)
+            stack.push_back(node.children[1]);
+    }
+}
+
+void Map::boxAreas(const glm::vec3& min, const glm::vec3& max, std::vector<int>& areas) const
+{
+    std::vector<int> leaves;
+    boxLeaves(min, max, leaves);
+    for (size_t i = 0; i < leaves.size(); i++)
+    {
+        int area = leafArray[leaves[i]].area;
+        if (area >= 0 && std::find(areas.begin(), areas.end(), area) == areas.end())
+            areas.push_back(area);
+    }
+}
+
+void Map::findAreaPortals()
+{
+    areaCount = 0;
+    for (size_t i = 0; i < leafArray.size(); i++)
+        areaCount = std::max(areaCount, leafArray[i].area + 1);
+    areaVisibleArray.assign(areaCount, 1);
+    areaPortalArray.clear();
+    visArea = -1;
+    areasChanged = true;
+    if (nodeArray.empty())
+        return;
+
+    // The compiler splits areas at the area portal brushes placed in
+    // doorways, so a door whose model touches exactly two areas is the
+    // portal between them. The bounds are grown by a unit first, as the
+    // game does when it links the door, so a door flush with the portal
+    // brush still reaches the leaves on both sides.
+    std::vector<int> areas;
+    for (size_t i = 0; i < entityArray.size(); i++)
+    {
+        const Entity& entity = entityArray[i];
+        std::string model = entity.value("model");
+        if (entity.value("classname").compare(0, 9, "func_door") != 0 || model.length() < 2 || model[0] != '*')
+            continue;
+        int index = atoi(model.c_str() + 1);
+        if (index <= 0 || index >= (int)modelArray.size())
+            continue;
+
+        areas.clear();
+        boxAreas(modelArray[index].min - glm::vec3(1.f), modelArray[index].max + glm::vec3(1.f), areas);
+        if (areas.size() != 2)
+            continue;
+
+        AreaPortal portal;
+        portal.areas[0] = areas[0];
+        portal.areas[1] = areas[1];
+        portal.model = index;
+        portal.open = (entity.intValue("spawnflags", 0) & 1) != 0;
+        areaPortalArray.push_back(portal);
+    }
+}
+
+void Map::findInstances()
+{
+    instanceArray.clear();
+    std::vector<bool> placed(modelArray.size(), false);
+    for (size_t i = 0; i < entityArray.size(); i++)
+    {
+        const Entity& entity = entityArray[i];
+        std::string classname = entity.value("classname");
+        std::string model = entity.value("model");
+        if (classname.compare(0, 5, "func_") != 0 || model.length() < 2 || model[0] != '*')
+            continue;
+        int index = atoi(model.c_str() + 1);
+        if (index <= 0 || index >= (int)modelArray.size() || placed[index])
+            continue;
+        placed[index] = true;
+
+        ModelInstance instance;
+        instance.model = index;
+        instance.openOffset = glm::vec3(0.f);
+        instance.open = false;
+
+        // Doors slide along their angle until only the lip is left in the
+        // doorway, -1 is up and -2 is down
+        const Model& source = modelArray[index];
+        if (classname == "func_door")
+        {
+            float angle = atof(entity.value("angle").c_str());
+            std::string lipValue = entity.value("lip");
+            float lip = lipValue.empty() ? 8.f : atof(lipValue.c_str());
+            glm::vec3 dir;
+            if (angle == -1.f)
+                dir = glm::vec3(0.f, 0.f, 1.f);
+            else if (angle == -2.f)
+                dir = glm::vec3(0.f, 0.f, -1.f);
+            else
+                dir = glm::vec3(cos(angle * 3.14159265f / 180.f), sin(angle * 3.14159265f / 180.f), 0.f);
+            float distance = glm::dot(glm::abs(dir), source.max - source.min) - lip;
+            instance.openOffset = dir * std::max(distance, 0.f);
+            instance.open = (entity.intValue("spawnflags", 0) & 1) != 0;
+        }
+
+        std::vector<int>& vertices = instance.vertices;
+        for (int j = 0; j < source.faceCount; j++)
+        {
+            const Face& face = faceArray[source.faceOffset + j];
+            for (int k = 0; k < face.meshIndexCount; k++)
+                vertices.push_back(meshIndexArray[face.meshIndexOffset + k]);
+            instance.baseFaceNormals.push_back(facePlaneArray[source.faceOffset + j].normal);
+        }
+        std::sort(vertices.begin(), vertices.end());
+        vertices.erase(std::unique(vertices.begin(), vertices.end()), vertices.end());
+        for (size_t j = 0; j < vertices.size(); j++)
+        {
+            instance.basePositions.push_back(vertexArray[vertices[j]].position);
+            instance.baseNormals.push_back(vertexArray[vertices[j]].normal);
+        }
+
+        instanceArray.push_back(instance);
+        placeInstance(instanceArray.size() - 1, glm::mat4(1.f));
+    }
+    instanceStampArray.assign(instanceArray.size(), 0);
+    instanceGeneration = 0;
+    gridDirty = true;
+}
+
+void Map::placeInstance(int index, const glm::mat4& transform)
+{
+    ModelInstance& instance = instanceArray[index];
+    instance.transform = transform;
+    instance.inverse = glm::inverse(transform);
+    instance.moved = transform != glm::mat4(1.f);
+
+    glm::mat3 rotation(transform);
+    for (size_t i = 0; i < instance.vertices.size(); i++)
+    {
+        Vertex& vertex = vertexArray[instance.vertices[i]];
+        vertex.position = glm::vec3(transform * glm::vec4(instance.basePositions[i], 1.f));
+        vertex.normal = rotation * instance.baseNormals[i];
+    }
+
+    const Model& model = modelArray[instance.model];
+    for (int i = 0; i < model.faceCount; i++)
+    {
+        int face = model.faceOffset + i;
+        updateFaceBounds(face);
+        Plane& plane = facePlaneArray[face];
+        plane.normal = rotation * instance.baseFaceNormals[i];
+        plane.distance = glm::dot(plane.normal, faceCentroidArray[face]);
+    }
+
+    for (int i = 0; i < 8; i++)
+    {
+        glm::vec3 corner((i & 1) ? model.max.x : model.min.x, (i & 2) ? model.max.y : model.min.y,
+                         (i & 4) ? model.max.z : model.min.z);
+        glm::vec3 world(transform * glm::vec4(corner, 1.f));
+        instance.min = i == 0 ? world : glm::min(instance.min, world);
+        instance.max = i == 0 ? world : glm::max(instance.max, world);
+    }
+    instance.leaves.clear();
+    if (!nodeArray.empty())
+        boxLeaves(instance.min, instance.max, instance.leaves);
+    gridDirty = true;
+}
+
+void Map::updateFaceBounds(int index)
+{
+    const Face& face = faceArray[index];
+    glm::vec3 sum(0.f);
+    glm::vec3 min(0.f);
+    glm::vec3 max(0.f);
+    for (int j = 0; j < face.meshIndexCount; j++)
+    {
+        const glm::vec3& position = vertexArray[meshIndexArray[face.meshIndexOffset + j]].position;
+        min = j == 0 ? position : glm::min(min, position);
+        max = j == 0 ? position : glm::max(max, position);
+        sum += position;
+    }
+    faceBounds.set(index, min, max);
+    faceCentroidArray[index] = face.meshIndexCount > 0 ? sum / float(face.meshIndexCount) : sum;
+}
+
+int Map::findLeaf(glm::vec3& pos)
+{
+    int index = 0;
+    while (index >= 0)
+    {
+        const CompactNode& node = compactNodeArray[index];
+        // The front child is the next node, the back one may be far away
+        if (node.children[1] >= 0)
+            PREFETCH(&compactNodeArray[node.children[1]]);
+        if (glm::dot(node.normal, pos) >= node.distance)
+        {
+            index = node.children[0];
+        }
+        else
+        {
+            index = node.children[1];
+        }
+    }
+    return ~index;
+}
+
+LightVol Map::findLightVol(glm::vec3& pos)
+{
+    if (lightVolArray.size() == 0)
+        return LightVol();
+    int cellX = int(floor(pos.x / 64) - ceil(modelArray[0].min.x / 64));
+    int cellY = int(floor(pos.y / 64) - ceil(modelArray[0].min.y / 64));
+    int cellZ = int(floor(pos.z / 128) - ceil(modelArray[0].min.z / 128));
+    cellX = std::min(std::max(cellX, 0), (int)lightVolSizeX);
+    cellY = std::min(std::max(cellY, 0), (int)lightVolSizeY);
+    cellZ = std::min(std::max(cellZ, 0), (int)lightVolSizeZ);
+    unsigned int index = cellX;
+    index += cellY * lightVolSizeX;
+    index += cellZ * lightVolSizeX * lightVolSizeY;
+    return lightVolArray[index];
+}
+
+bool Map::faceBackfacing(int index, const RenderPass& pass) const
+{
+    // Distance of the box corner furthest in front of the plane
+    const Plane& plane = facePlaneArray[index];
+    float dist = glm::dot(plane.normal, pass.eyeCentre) + glm::dot(glm::abs(plane.normal), pass.eyeExtent) - plane.distance;
+    return dist < -BACKFACE_EPSILON;
+}
+
+void Map::queueFace(int index, RenderPass& pass)
+{
+    const Face& face = faceArray[index];
+    const Shader& shader = shaderArray[face.shader];
+    if (!shader.render)
+        return;
+
+    glm::vec3 offset = faceCentroidArray[index] - pass.pos;
+    RenderItem item;
+    item.texture = shader.texture;
+    item.lightMap = lightMapArray[face.lightMap];
+    item.depth = glm::dot(offset, offset);
+    item.face = index;
+    if (shader.transparent)
+        transparentList.items.push_back(item);
+    else
+        opaqueList.items.push_back(item);
+}
+
+
+// Opaque faces are drawn by state and front to back within a state so the
+// depth test rejects as much as possible.
+static bool compareRenderItems(const RenderItem& a, const RenderItem& b)
+{
+    if (a.texture != b.texture)
+        return a.texture < b.texture;
+    if (a.lightMap != b.lightMap)
+        return a.lightMap < b.lightMap;
+    return a.depth < b.depth;
+}
+
+// Transparent faces are blended back to front
+static bool compareBackToFront(const RenderItem& a, const RenderItem& b)
+{
+    if (a.depth != b.depth)
+        return a.depth > b.depth;
+    return a.face < b.face;
+}
+
+void Map::buildFaceList(FaceList& faces)
+{
+    // Faces of every leaf in the current PVS, each once. Opaque ones are
+    // stored in state order so sorting the queue built from them is cheap.
+    std::vector<RenderItem> items;
+    std::vector<bool> listed(faceArray.size(), false);
+    for (size_t i = 0; i < visibleLeafArray.size(); i++)
+    {
+        const Leaf& leaf = leafArray[visibleLeafArray[i]];
+        for (int j = 0; j < leaf.faceCount; j++)
+        {
+            int index = leafFaceArray[j + leaf.faceOffset];
+            const Shader& shader = shaderArray[faceArray[index].shader];
+            if (listed[index] || !shader.render)
+                continue;
+            listed[index] = true;
+
+            if (shader.transparent)
+            {
+                faces.transparent.push_back(index);
+                continue;
+            }
+
+            RenderItem item;
+            item.texture = shader.texture;
+            item.lightMap = lightMapArray[faceArray[index].lightMap];
+            item.depth = 0.f;
+            item.face = index;
+            items.push_back(item);
+        }
+    }
+    std::sort(items.begin(), items.end(), compareRenderItems);
+
+    faces.opaque.resize(items.size());
+    for (size_t i = 0; i < items.size(); i++)
+        faces.opaque[i] = items[i].face;
+}
+
+void Map::renderFaceList(const std::vector<int>& faces, RenderPass& pass)
+{
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        int index = faces[i];
+        if (!faceInsideArray[index])
+            stats.frustumCulled++;
+        else if (faceBackfacing(index, pass))
+            stats.backfaceCulled++;
+        else if (useOcclusion && occlusion.occluded(faceBounds.min(index), faceBounds.max(index)))
+            stats.occluded++;
+        else
+            queueFace(index, pass);
+    }
+}
+
+void Map::buildDrawList(DrawList& list, bool (*compare)(const RenderItem&, const RenderItem&))
+{
+    // Neighbouring faces sharing a texture and lightmap are merged into one
+    // batch, their indices are copied into the list's index buffer so that
+    // each batch is a single draw call.
+    std::sort(list.items.begin(), list.items.end(), compare);
+
+    list.batches.clear();
+    list.indices.clear();
+    for (size_t i = 0; i < list.items.size(); i++)
+    {
+        const RenderItem& item = list.items[i];
+        const Face& face = faceArray[item.face];
+        if (list.batches.empty() || list.batches.back().texture != item.texture || list.batches.back().lightMap != item.lightMap)
+        {
+            Batch batch;
+            batch.texture = item.texture;
+            batch.lightMap = item.lightMap;
+            batch.indexOffset = list.indices.size();
+            batch.indexCount = 0;
+            list.batches.push_back(batch);
+        }
+        std::vector<GLuint>::const_iterator indices = meshIndexArray.begin() + face.meshIndexOffset;
+        list.indices.insert(list.indices.end(), indices, indices + face.meshIndexCount);
+        list.batches.back().indexCount += face.meshIndexCount;
+    }
+
+    if (list.indices.empty())
+        return;
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, list.indexBuffer);
+    glBufferData(GL_ELEMENT_ARRAY_BUFFER, list.indices.size() * sizeof(GLuint), &list.indices[0], GL_DYNAMIC_DRAW);
+}
+
+void Map::drawBatches(const DrawList& list)
+{
+    stats.faces += list.items.size();
+    if (list.indices.empty())
+        return;
+
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, list.indexBuffer);
+    for (size_t i = 0; i < list.batches.size(); i++)
+    {
+        const Batch& batch = list.batches[i];
+        if (state.bindTexture(0, batch.texture))
+            stats.textureBinds++;
+        if (state.bindTexture(1, batch.lightMap))
+            stats.textureBinds++;
+
+        glDrawElements(GL_TRIANGLES, batch.indexCount, GL_UNSIGNED_INT, (void*)(long)(batch.indexOffset * sizeof(GLuint)));
+        stats.drawCalls++;
+    }
+}
+
+void Map::collectSubtrees(int index, RenderPass& pass, unsigned int planes, int depth)
+{
+    // The top of the tree is walked here in the same order cullNode would,
+    // so merging the subtrees in order gives the serial result.
+    if (depth == 0 || index < 0)
+    {
+        Subtree subtree;
+        subtree.node = index;
+        subtree.planes = planes;
+        subtreeArray.push_back(subtree);
+        return;
+    }
+
+    if (nodeVisFrameArray[index] != visFrame)
+        return;
+    if (planes)
+    {
+        stats.boxTests++;
+        if (pass.frutsum.classifyAABB(nodeBounds.min(index), nodeBounds.max(index), planes) == Frutsum::Outside)
+            return;
+    }
+    if (useOcclusion && occlusion.occluded(nodeBounds.min(index), nodeBounds.max(index)))
+    {
+        stats.occluded++;
+        return;
+    }
+    stats.nodes++;
+
+    const CompactNode& node = compactNodeArray[index];
+    if (glm::dot(node.normal, pass.pos) >= node.distance)
+    {
+        collectSubtrees(node.children[0], pass, planes, depth - 1);
+        collectSubtrees(node.children[1], pass, planes, depth - 1);
+    }
+    else
+    {
+        collectSubtrees(node.children[1], pass, planes, depth - 1);
+        collectSubtrees(node.children[0], pass, planes, depth - 1);
+    }
+}
+
+void Map::cullNode(int index, const RenderPass& pass, unsigned int planes, CullOutput& out) const
+{
+    std::vector<Subtree>& stack = out.stack;
+    stack.clear();
+    Subtree root;
+    root.node = index;
+    root.planes = planes;
+    stack.push_back(root);
+
+    while (!stack.empty())
+    {
+        // planes holds the frustum planes the parent straddles, a box
+        // entirely inside the frustum passes everything below it without a
+        // test.
+        index = stack.back().node;
+        planes = stack.back().planes;
+        stack.pop_back();
+
+        if (index < 0)
+        {
+            const Leaf& leaf = leafArray[~index];
+            if (!leafVisible(leaf))
+                continue;
+            if (planes)
+            {
+                out.boxTests++;
+                if (pass.frutsum.classifyAABB(leafBounds.min(~index), leafBounds.max(~index), planes) == Frutsum::Outside)
+                    continue;
+            }
+            if (useOcclusion && occlusion.occluded(leafBounds.min(~index), leafBounds.max(~index)))
+            {
+                out.occluded++;
+                continue;
+            }
+
+            for (int i = 0; i < leaf.faceCount; i++)
+            {
+                out.faces.push_back(leafFaceArray[i + leaf.faceOffset]);
+                out.faceMasks.push_back(planes);
+            }
+            continue;
+        }
+
+        // Nothing below this node is in the PVS
+        if (nodeVisFrameArray[index] != visFrame)
+            continue;
+
+        if (planes)
+        {
+            out.boxTests++;
+            if (pass.frutsum.classifyAABB(nodeBounds.min(index), nodeBounds.max(index), planes) == Frutsum::Outside)
+                continue;
+        }
+        if (useOcclusion && occlusion.occluded(nodeBounds.min(index), nodeBounds.max(index)))
+        {
+            out.occluded++;
+            continue;
+        }
+        out.nodes++;
+
+        // Nearest child first, so faces are queued roughly front to back.
+        // It is pushed last and the other child is fetched while the near
+        // side is walked.
+        const CompactNode& node = compactNodeArray[index];
+        int side = glm::dot(node.normal, pass.pos) >= node.distance ? 0 : 1;
+        Subtree next;
+        next.planes = planes;
+        next.node = node.children[side ^ 1];
+        if (next.node >= 0)
+            PREFETCH(&compactNodeArray[next.node]);
+        stack.push_back(next);
+        next.node = node.children[side];
+        stack.push_back(next);
+    }
+}
+
+// The walk cullNode did before the nodes were compacted, recursing through
+// the node and plane lumps. nodes is the lump in either order with its
+// bounds and visible frames. Only kept to benchmark against.
+int Map::walkNodeArray(const std::vector<Node>& nodes, const BoundsArray& bounds, const std::vector<unsigned int>& visFrames,
+                       int index, const Frutsum& frutsum, const glm::vec3& pos, unsigned int planes) const
+{
+    if (index < 0)
+    {
+        const Leaf& leaf = leafArray[~index];
+        if (!leafVisible(leaf))
+            return 0;
+        if (planes && frutsum.classifyAABB(leafBounds.min(~index), leafBounds.max(~index), planes) == Frutsum::Outside)
+            return 0;
+        return leaf.faceCount;
+    }
+
+    if (visFrames[index] != visFrame)
+        return 0;
+    if (planes && frutsum.classifyAABB(bounds.min(index), bounds.max(index), planes) == Frutsum::Outside)
+        return 0;
+
+    const Node& node = nodes[index];
+    const Plane& plane = planeArray[node.plane];
+    int side = glm::dot(plane.normal, pos) >= plane.distance ? 0 : 1;
+    return walkNodeArray(nodes, bounds, visFrames, node.children[side], frutsum, pos, planes) +
+           walkNodeArray(nodes, bounds, visFrames, node.children[side ^ 1], frutsum, pos, planes);
+}
+
+void Map::cullSubtrees(int begin, int end, const RenderPass& pass)
+{
+    for (int i = begin; i < end; i++)
+    {
+        CullOutput& out = cullOutputArray[i];
+        out.faces.clear();
+        out.faceMasks.clear();
+        out.nodes = 0;
+        out.boxTests = 0;
+        out.occluded = 0;
+        cullNode(subtreeArray[i].node, pass, subtreeArray[i].planes, out);
+    }
+}
+
+void Map::drawOccluders(const RenderPass& pass)
+{
+    // The candidates covering the most of the view, front facing and at
+    // least partly inside the frustum. Faces outside the PVS still hide
+    // what is behind them.
+    occluderScoreArray.clear();
+    for (size_t i = 0; i < occluderArray.size(); i++)
+    {
+        int index = occluderArray[i].face;
+        const Plane& plane = facePlaneArray[index];
+        if (glm::dot(plane.normal, pass.pos) - plane.distance <= 0.f)
+            continue;
+        unsigned int planes = Frutsum::AllPlanes;
+        if (pass.frutsum.classifyAABB(faceBounds.min(index), faceBounds.max(index), planes) == Frutsum::Outside)
+            continue;
+
+        glm::vec3 offset = faceCentroidArray[index] - pass.pos;
+        float score = occluderArray[i].area / std::max(glm::dot(offset, offset), 1.f);
+        occluderScoreArray.push_back(std::make_pair(score, index));
+    }
+    if (occluderScoreArray.size() > MAX_OCCLUDERS)
+    {
+        std::nth_element(occluderScoreArray.begin(), occluderScoreArray.begin() + MAX_OCCLUDERS,
+                         occluderScoreArray.end(), std::greater<std::pair<float, int> >());
+        occluderScoreArray.resize(MAX_OCCLUDERS);
+    }
+
+    occlusion.begin(pass.matrix);
+    glm::vec3 corners[OcclusionBuffer::MaxCorners];
+    for (size_t i = 0; i < occluderScoreArray.size(); i++)
+    {
+        const Face& face = faceArray[occluderScoreArray[i].second];
+        for (int j = 0; j < face.vertexCount; j++)
+            corners[j] = vertexArray[face.vertexOffset + j].position;
+        occlusion.addPolygon(corners, face.vertexCount);
+    }
+    occlusion.rasterize(useParallelCulling);
+    stats.occluders = occlusion.polygonCount();
+}
+
+void Map::cullFaces(RenderPass& pass)
+{
+    JobSystem& jobs = JobSystem::instance();
+
+    if (useFaceCache)
+    {
+        if (useParallelCulling)
+        {
+            int blocks = faceBounds.size() / BoundsArray::Width;
+            int grain = CULL_FACE_GRAIN / BoundsArray::Width;
+            jobs.parallelFor(blocks, grain, [this, &pass](int begin, int end) {
+                pass.frutsum.insideAABBs(faceBounds, begin * BoundsArray::Width,
+                                         (end - begin) * BoundsArray::Width, faceInsideArray.data());
+            });
+        }
+        else
+        {
+            pass.frutsum.insideAABBs(faceBounds, faceInsideArray.data());
+        }
+
+        const FaceList* faces = faceCache.find(pass.cluster);
+        if (!faces)
+        {
+            FaceList built;
+            buildFaceList(built);
+            faces = &faceCache.insert(pass.cluster, built);
+        }
+        renderFaceList(faces->opaque, pass);
+        renderFaceList(faces->transparent, pass);
+        return;
+    }
+
+    subtreeArray.clear();
+    collectSubtrees(0, pass, Frutsum::AllPlanes, useParallelCulling ? CULL_SPLIT_DEPTH : 0);
+    if (cullOutputArray.size() < subtreeArray.size())
+        cullOutputArray.resize(subtreeArray.size());
+
+    if (useParallelCulling)
+    {
+        jobs.parallelFor(subtreeArray.size(), 1, [this, &pass](int begin, int end) {
+            cullSubtrees(begin, end, pass);
+        });
+    }
+    else
+    {
+        cullSubtrees(0, subtreeArray.size(), pass);
+    }
+
+    // Merge in subtree order, the first time a face is seen wins just like
+    // it does in a single walk.
+    for (size_t i = 0; i < subtreeArray.size(); i++)
+    {
+        const CullOutput& out = cullOutputArray[i];
+        stats.nodes += out.nodes;
+        stats.boxTests += out.boxTests;
+        stats.occluded += out.occluded;
+        for (size_t j = 0; j < out.faces.size(); j++)
+        {
+            int index = out.faces[j];
+            if (faceStampArray[index] == pass.stamp)
+                continue;
+            faceStampArray[index] = pass.stamp;
+
+            // Only the planes the face's leaf straddles can reject it
+            unsigned int planes = out.faceMasks[j];
+            if (planes && pass.frutsum.classifyAABB(faceBounds.min(index), faceBounds.max(index), planes) == Frutsum::Outside)
+                stats.frustumCulled++;
+            else if (faceBackfacing(index, pass))
+                stats.backfaceCulled++;
+            else if (useOcclusion && occlusion.occluded(faceBounds.min(index), faceBounds.max(index)))
+                stats.occluded++;
+            else
+                queueFace(index, pass);
+        }
+    }
+}
+
+void Map::cullInstances(RenderPass& pass)
+{
+    // An instance is drawn from the clusters and areas its bounds touch,
+    // its faces go through the same tests as the world's
+    for (size_t i = 0; i < instanceArray.size(); i++)
+    {
+        const ModelInstance& instance = instanceArray[i];
+        bool visible = false;
+        for (size_t j = 0; j < instance.leaves.size() && !visible; j++)
+            visible = leafVisible(leafArray[instance.leaves[j]]);
+        if (!visible)
+            continue;
+
+        unsigned int planes = Frutsum::AllPlanes;
+        stats.boxTests++;
+        if (pass.frutsum.classifyAABB(instance.min, instance.max, planes) == Frutsum::Outside)
+            continue;
+        if (useOcclusion && occlusion.occluded(instance.min, instance.max))
+        {
+            stats.occluded++;
+            continue;
+        }
+        stats.models++;
+
+        const Model& model = modelArray[instance.model];
+        for (int j = 0; j < model.faceCount; j++)
+        {
+            int index = model.faceOffset + j;
+            if (planes && pass.frutsum.classifyAABB(faceBounds.min(index), faceBounds.max(index), planes) == Frutsum::Outside)
+                stats.frustumCulled++;
+            else if (faceBackfacing(index, pass))
+                stats.backfaceCulled++;
+            else if (useOcclusion && occlusion.occluded(faceBounds.min(index), faceBounds.max(index)))
+                stats.occluded++;
+            else
+                queueFace(index, pass);
+        }
+    }
+}
+
+static glm::mat4 widenFrustum(const glm::mat4& matrix)
+{
+    // Scaling clip space down pushes every frustum plane outwards
+    glm::mat4 scale(1.f);
+    scale[0][0] = 1.f / VIEW_MARGIN;
+    scale[1][1] = 1.f / VIEW_MARGIN;
+    scale[2][2] = 1.f / VIEW_MARGIN;
+    return scale * matrix;
+}
+
+static bool frustumContains(const glm::mat4& outer, const glm::mat4& inner)
+{
+    // A frustum is convex, it is inside another if all its corners are
+    glm::mat4 inverse = glm::inverse(inner);
+    for (int i = 0; i < 8; i++)
+    {
+        glm::vec4 corner((i & 1) ? 1.f : -1.f, (i & 2) ? 1.f : -1.f, (i & 4) ? 1.f : -1.f, 1.f);
+        glm::vec4 world = inverse * corner;
+        if (world.w == 0.f)
+            return false;
+        glm::vec4 clip = outer * (world / world.w);
+        if (clip.w <= 0.f || std::fabs(clip.x) > clip.w || std::fabs(clip.y) > clip.w || std::fabs(clip.z) > clip.w)
+            return false;
+    }
+    return true;
+}
+
+void Map::renderWorld(glm::mat4 matrix, glm::vec3 pos)
+{
+    if (headless)
+        return;
+
+    state.resetCounters();
+    glFrontFace(GL_CW);
+    state.setEnabled(RenderState::Texture2D, true);
+    state.setEnabled(RenderState::DepthTest, true);
+    glDepthFunc(GL_LEQUAL);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+
+    if (nodeArray.size() == 0)
+        return;
+
+    // The indirect renderer's vertex array is only bound once the lists are
+    // built, uploading their indices must not replace its element buffer.
+    bool gpuDriven = indirect && useIndirect;
+    if (!gpuDriven)
+    {
+        state.useProgram(program);
+        glEnableVertexAttribArray(0);
+        //glEnableVertexAttribArray(1);
+        glEnableVertexAttribArray(2);
+        glEnableVertexAttribArray(3);
+        glUniformMatrix4fv(matrixLoc, 1, GL_FALSE, &matrix[0][0]);
+        glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexPosition);
+        //glVertexAttribPointer(1, 3, GL_FLOAT, GL_TRUE,  sizeof(Vertex), VertexNormal);
+        glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexTexCoord);
+        glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), VertexLMCoord);
+    }
+
+    int leaf = findLeaf(pos);
+    int cluster = leafArray[leaf].cluster;
+    updateVisibility(cluster, leafArray[leaf].area);
+    stats = RenderStats();
+
+    // The lists are culled against a frustum slightly wider than the view.
+    // While the camera stays in the same leaf and the view stays inside
+    // that frustum they are still complete and are drawn again as they are.
+    // What the occluders hide changes with any movement, so with occlusion
+    // culling only an unchanged view reuses them.
+    stats.reused = useTemporal && leaf == lastLeaf &&
+                   (useOcclusion ? matrix == lastViewMatrix : frustumContains(lastMatrix, matrix));
+    if (!stats.reused)
+    {
+        glm::mat4 cullMatrix = useTemporal ? widenFrustum(matrix) : matrix;
+        RenderPass pass(this, pos, cullMatrix);
+        pass.matrix = matrix;
+        pass.cluster = cluster;
+        if (useTemporal)
+        {
+            // The lists are kept while the eye stays in this leaf
+            pass.eyeCentre = (leafBounds.min(leaf) + leafBounds.max(leaf)) * 0.5f;
+            pass.eyeExtent = (leafBounds.max(leaf) - leafBounds.min(leaf)) * 0.5f;
+        }
+
+        // One traversal, or one walk over the cluster's cached lists, sorts
+        // the faces into the opaque and transparent lists.
+        opaqueList.items.clear();
+        transparentList.items.clear();
+        if (useOcclusion)
+            drawOccluders(pass);
+        cullFaces(pass);
+        cullInstances(pass);
+        buildDrawList(opaqueList, compareRenderItems);
+        buildDrawList(transparentList, compareBackToFront);
+
+        lastLeaf = leaf;
+        lastMatrix = cullMatrix;
+        lastViewMatrix = matrix;
+        lastPos = pos;
+    }
+    else if (pos != lastPos)
+    {
+        // Transparent faces are ordered by their distance from the eye, the
+        // reused list is sorted again for where the eye is now
+        for (size_t i = 0; i < transparentList.items.size(); i++)
+        {
+            RenderItem& item = transparentList.items[i];
+            glm::vec3 offset = faceCentroidArray[item.face] - pos;
+            item.depth = glm::dot(offset, offset);
+        }
+        buildDrawList(transparentList, compareBackToFront);
+        lastPos = pos;
+    }
+
+    if (gpuDriven)
+        indirect->begin(matrix, state);
+
+    state.setEnabled(RenderState::CullFace, true);
+    state.setEnabled(RenderState::Blend, false);
+    if (gpuDriven)
+        indirect->draw(opaqueList.items, true, state, stats);
+    else
+        drawBatches(opaqueList);
+
+    state.setEnabled(RenderState::CullFace, false);
+    state.setEnabled(RenderState::Blend, true);
+    glBlendFunc(GL_SRC_ALPHA, GL_ONE_MINUS_SRC_ALPHA);
+    if (gpuDriven)
+        indirect->draw(transparentList.items, false, state, stats);
+    else
+        drawBatches(transparentList);
+
+    if (gpuDriven)
+        indirect->end();
+
+    // Enabled capabilities, the program and the textures stay as they are
+    // for the next frame, the state cache knows about them.
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, 0);
+}
+
+bool Map::setIndirectRendering(bool enabled)
+{
+    if (enabled && !indirect)
+        return false;
+    useIndirect = enabled;
+    return true;
+}
+
+bool Map::indirectRendering() const
+{
+    return useIndirect;
+}
+
+void Map::setFaceCache(bool enabled)
+{
+    useFaceCache = enabled;
+    lastLeaf = -1;
+}
+
+bool Map::faceCacheEnabled() const
+{
+    return useFaceCache;
+}
+
+void Map::setFaceCacheBudget(std::size_t bytes)
+{
+    faceCache.setBudget(bytes);
+}
+
+void Map::setTemporalReuse(bool enabled)
+{
+    useTemporal = enabled;
+    lastLeaf = -1;
+}
+
+bool Map::temporalReuseEnabled() const
+{
+    return useTemporal;
+}
+
+void Map::setParallelCulling(bool enabled)
+{
+    useParallelCulling = enabled;
+}
+
+bool Map::parallelCullingEnabled() const
+{
+    return useParallelCulling;
+}
+
+void Map::setOcclusionCulling(bool enabled)
+{
+    useOcclusion = enabled;
+    // The lists were culled for the other setting
+    lastLeaf = -1;
+}
+
+bool Map::occlusionCullingEnabled() const
+{
+    return useOcclusion;
+}
+
+int Map::areaPortalCount() const
+{
+    return areaPortalArray.size();
+}
+
+bool Map::areaPortalOpen(int portal) const
+{
+    return areaPortalArray[portal].open;
+}
+
+void Map::setAreaPortalOpen(int portal, bool open)
+{
+    if (areaPortalArray[portal].open == open)
+        return;
+    areaPortalArray[portal].open = open;
+
+    for (size_t i = 0; i < instanceArray.size(); i++)
+    {
+        ModelInstance& instance = instanceArray[i];
+        if (instance.model != areaPortalArray[portal].model)
+            continue;
+        instance.open = open;
+        setModelTransform(i, open ? glm::translate(glm::mat4(1.f), instance.openOffset) : glm::mat4(1.f));
+    }
+
+    // Cached lists and the last frame's lists may now be missing areas or
+    // hold ones that are no longer reachable
+    areasChanged = true;
+    faceCache.clear();
+    lastLeaf = -1;
+}
+
+int Map::modelInstanceCount() const
+{
+    return instanceArray.size();
+}
+
+void Map::setModelTransform(int instance, const glm::mat4& transform)
+{
+    placeInstance(instance, transform);
+
+    // Uploads the span between the first and last vertex, the world
+    // vertices inside it are unchanged
+    const std::vector<int>& vertices = instanceArray[instance].vertices;
+    if (!headless && !vertices.empty())
+    {
+        int first = vertices.front();
+        int count = vertices.back() - first + 1;
+        glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+        glBufferSubData(GL_ARRAY_BUFFER, first * sizeof(Vertex), count * sizeof(Vertex), &vertexArray[first]);
+        glBindBuffer(GL_ARRAY_BUFFER, 0);
+    }
+
+    // The last frame's lists were culled with the faces where they were
+    lastLeaf = -1;
+}
+
+void Map::printStats() const
+{
+    std::cout << "Renderer: " << (useIndirect ? "multi-draw-indirect" : "fallback")
+              << ", culling: " << Frutsum::kernelName(Frutsum::kernel()) << " on "
+              << (useParallelCulling ? JobSystem::instance().workerCount() + 1 : 1) << " thread(s)" << std::endl;
+    int clusters = 0;
+    for (size_t i = 0; i < visibleClusters.size(); i++)
+    {
+        for (uint64_t word = visibleClusters[i]; word != 0; word &= word - 1)
+            clusters++;
+    }
+    int areas = std::count(areaVisibleArray.begin(), areaVisibleArray.end(), 1);
+    int portals = 0;
+    for (size_t i = 0; i < areaPortalArray.size(); i++)
+        portals += areaPortalArray[i].open;
+    std::cout << "Visible clusters: " << clusters
+              << ", visible leaves: " << visibleLeafArray.size() << std::endl;
+    std::cout << "Reachable areas: " << areas << " of " << areaCount
+              << ", open portals: " << portals << " of " << areaPortalArray.size() << std::endl;
+    std::cout << "Visible set: " << (stats.reused ? "reused" : "rebuilt") << std::endl;
+    std::cout << "Models: " << stats.models << " of " << instanceArray.size() << " drawn" << std::endl;
+    std::cout << "Nodes: " << stats.nodes
+              << ", frustum tests: " << stats.boxTests
+              << ", faces: " << stats.faces
+              << " (" << stats.backfaceCulled << " backfacing and "
+              << stats.frustumCulled << " outside the frustum culled)"
+              << ", draw calls: " << stats.drawCalls
+              << ", texture binds: " << stats.textureBinds << std::endl;
+    if (useOcclusion)
+    {
+        std::cout << "Occlusion: " << stats.occluders << " occluders hid " << stats.occluded
+                  << " nodes, leaves, models and faces" << std::endl;
+    }
+    std::cout << "GL state calls: " << state.issued() << " issued, "
+              << state.skipped() << " skipped" << std::endl;
+    if (useFaceCache)
+    {
+        unsigned int lookups = faceCache.hits() + faceCache.misses();
+        std::cout << "Face list cache: " << faceCache.hits() << " hits, "
+                  << faceCache.misses() << " misses ("
+                  << (lookups ? faceCache.hits() * 100 / lookups : 0) << "% hit rate), "
+                  << faceCache.size() << " lists, "
+                  << faceCache.memory() / 1024 << " of " << faceCache.budget() / 1024 << " KB" << std::endl;
+    }
+}
+
+// Looking in random directions from the centres of random leaves that are
+// inside the map
+static bool benchmarkViews(const std::vector<Leaf>& leafArray, int count, std::vector<glm::vec3>& positions,
+                           std::vector<glm::mat4>& matrices, std::vector<Frutsum>& views)
+{
+    std::vector<int> leaves;
+    for (size_t i = 0; i < leafArray.size(); i++)
+    {
+        if (leafArray[i].cluster >= 0)
+            leaves.push_back(i);
+    }
+    if (leaves.empty())
+        return false;
+
+    srand(1);
+    glm::mat4 projection = glm::perspective(75.f * 3.14159265f / 180.f, 4.f / 3.f, 1.f, 9000.f);
+    for (int i = 0; i < count; i++)
+    {
+        const Leaf& leaf = leafArray[leaves[rand() % leaves.size()]];
+        glm::vec3 position = (glm::vec3(leaf.min[0], leaf.min[1], leaf.min[2]) +
+                              glm::vec3(leaf.max[0], leaf.max[1], leaf.max[2])) * 0.5f;
+        float yaw = (rand() % 360) * 3.14159265f / 180.f;
+        float pitch = (rand() % 180 - 90) * 3.14159265f / 180.f;
+        glm::mat4 view = glm::rotate(projection, -3.14159265f / 2.f, glm::vec3(1.f, 0.f, 0.f));
+        view = glm::rotate(view, pitch, glm::vec3(1.f, 0.f, 0.f));
+        view = glm::rotate(view, yaw, glm::vec3(0.f, 0.f, 1.f));
+        positions.push_back(position);
+        matrices.push_back(glm::translate(view, -position));
+        views.push_back(Frutsum(matrices.back()));
+    }
+    return true;
+}
+
+void Map::benchmarkCulling()
+{
+    const int viewCount = 256;
+    const int repeats = 20;
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::mat4> matrices;
+    std::vector<Frutsum> views;
+    if (!benchmarkViews(leafArray, viewCount, positions, matrices, views))
+        return;
+
+    size_t boxes = (nodeArray.size() + leafArray.size()) * views.size() * repeats;
+    std::cout << "Culling " << nodeArray.size() << " nodes and " << leafArray.size() << " leaves from "
+              << viewCount << " views, " << repeats << " times" << std::endl;
+
+    size_t inside = 0;
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+        for (size_t v = 0; v < views.size(); v++)
+        {
+            for (size_t i = 0; i < nodeArray.size(); i++)
+                inside += views[v].insideAABB(nodeArray[i].max, nodeArray[i].min);
+            for (size_t i = 0; i < leafArray.size(); i++)
+                inside += views[v].insideAABB(leafArray[i].max, leafArray[i].min);
+        }
+    }
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Frutsum::insideAABB: " << elapsed / boxes << " ns per box, " << inside << " inside" << std::endl;
+
+    std::vector<unsigned char> nodeInsideArray(nodeBounds.size());
+    std::vector<unsigned char> leafInsideArray(leafBounds.size());
+    Frutsum::Kernel previous = Frutsum::kernel();
+    const Frutsum::Kernel kernels[] = {Frutsum::Scalar, Frutsum::SSE, Frutsum::AVX};
+    for (int k = 0; k < 3; k++)
+    {
+        if (!Frutsum::setKernel(kernels[k]))
+            continue;
+
+        inside = 0;
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+        {
+            for (size_t v = 0; v < views.size(); v++)
+            {
+                views[v].insideAABBs(nodeBounds, nodeInsideArray.data());
+                views[v].insideAABBs(leafBounds, leafInsideArray.data());
+                for (size_t i = 0; i < nodeArray.size(); i++)
+                    inside += nodeInsideArray[i];
+                for (size_t i = 0; i < leafArray.size(); i++)
+                    inside += leafInsideArray[i];
+            }
+        }
+        elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << Frutsum::kernelName(kernels[k]) << " batch: " << elapsed / boxes << " ns per box, "
+                  << inside << " inside" << std::endl;
+    }
+    Frutsum::setKernel(previous);
+}
+
+void Map::benchmarkTraversal()
+{
+    const int pointCount = 100000;
+    const int viewCount = 256;
+    const int repeats = 20;
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::mat4> matrices;
+    std::vector<Frutsum> views;
+    if (nodeArray.empty() || !benchmarkViews(leafArray, viewCount, positions, matrices, views))
+        return;
+
+    std::vector<glm::vec3> points(pointCount);
+    const Model& world = modelArray[0];
+    for (int i = 0; i < pointCount; i++)
+    {
+        for (int j = 0; j < 3; j++)
+            points[i][j] = world.min[j] + (world.max[j] - world.min[j]) * (rand() / (float)RAND_MAX);
+    }
+
+    // The node lump is read again in the order of the file, with where each
+    // node went when renumbered, -1 if the root can't reach it
+    std::vector<Node> fileNodeArray;
+    MappedFile file;
+    ArrayView<Header> headerView;
+    ArrayView<Node> nodes;
+    if (!file.open(mapFileName) || !file.view(0, sizeof(Header), headerView) || headerView.empty() ||
+        !lumpView(file, headerView[0], NODE, nodes))
+    {
+        std::cout << mapFileName << ": Unable to read the node lump" << std::endl;
+        return;
+    }
+    fileNodeArray.assign(nodes.begin(), nodes.end());
+    for (size_t i = 0; i < fileNodeArray.size(); i++)
+    {
+        for (int j = 0; j < 2; j++)
+        {
+            int& child = fileNodeArray[i].children[j];
+            if (child >= (int)fileNodeArray.size())
+                child = -1;
+        }
+    }
+    std::vector<int> order;
+    std::vector<int> fileNodeOrder;
+    depthFirstNodes(fileNodeArray, order, fileNodeOrder);
+
+    std::cout << "Walking " << nodeArray.size() << " nodes, " << sizeof(CompactNode) << " bytes each compacted, "
+              << sizeof(Node) << " plus a " << sizeof(Plane) << " byte plane in the lumps" << std::endl;
+
+    // The lumps in file order show what the depth first order gains, the
+    // lumps in that order what inlining the planes gains on top
+    const std::vector<Node>* lumps[2] = { &fileNodeArray, &nodeArray };
+    const char* const lumpNames[2] = { "file order", "depth first order" };
+    long long check = 0;
+    for (int order = 0; order < 2; order++)
+    {
+        const std::vector<Node>& nodes = *lumps[order];
+        std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+        for (int i = 0; i < pointCount; i++)
+        {
+            int index = 0;
+            while (index >= 0)
+            {
+                const Node& node = nodes[index];
+                const Plane& plane = planeArray[node.plane];
+                index = node.children[glm::dot(plane.normal, points[i]) >= plane.distance ? 0 : 1];
+            }
+            check += ~index;
+        }
+        double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "findLeaf through the node and plane lumps in " << lumpNames[order] << ": "
+                  << elapsed / pointCount << " ns" << std::endl;
+    }
+
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    for (int i = 0; i < pointCount; i++)
+        check -= 2 * findLeaf(points[i]);
+    double elapsed = std::chrono::duration<double, std::nano>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "findLeaf on compact nodes: " << elapsed / pointCount << " ns"
+              << (check == 0 ? "" : ", leaves differ!") << std::endl;
+
+    // Everything in the PVS so the whole tree is open to the frustum
+    updateVisibility(-1, -1);
+    RenderPass pass(this, glm::vec3(0.f), glm::mat4(1.f));
+    CullOutput out;
+    bool occlusionWas = useOcclusion;
+    useOcclusion = false;
+
+    // Bounds and visible frames of the nodes in file order
+    BoundsArray fileNodeBounds;
+    fileNodeBounds.resize(fileNodeArray.size());
+    std::vector<unsigned int> fileVisFrames(fileNodeArray.size(), 0);
+    for (size_t i = 0; i < fileNodeArray.size(); i++)
+    {
+        fileNodeBounds.set(i, fileNodeArray[i].min, fileNodeArray[i].max);
+        if (fileNodeOrder[i] >= 0)
+            fileVisFrames[i] = nodeVisFrameArray[fileNodeOrder[i]];
+    }
+    const BoundsArray* bounds[2] = { &fileNodeBounds, &nodeBounds };
+    const std::vector<unsigned int>* visFrames[2] = { &fileVisFrames, &nodeVisFrameArray };
+
+    check = 0;
+    for (int order = 0; order < 2; order++)
+    {
+        start = std::chrono::steady_clock::now();
+        for (int r = 0; r < repeats; r++)
+        {
+            for (size_t v = 0; v < views.size(); v++)
+                check += walkNodeArray(*lumps[order], *bounds[order], *visFrames[order], 0, views[v], positions[v],
+                                       Frutsum::AllPlanes);
+        }
+        elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        std::cout << "Recursive walk through the node and plane lumps in " << lumpNames[order] << ": "
+                  << elapsed / (viewCount * repeats) << " us per view" << std::endl;
+    }
+
+    start = std::chrono::steady_clock::now();
+    for (int r = 0; r < repeats; r++)
+    {
+        for (size_t v = 0; v < views.size(); v++)
+        {
+            pass.pos = positions[v];
+            pass.frutsum = views[v];
+            out.faces.clear();
+            out.faceMasks.clear();
+            out.nodes = 0;
+            out.boxTests = 0;
+            out.occluded = 0;
+            cullNode(0, pass, Frutsum::AllPlanes, out);
+            check -= 2 * out.faces.size();
+        }
+    }
+    elapsed = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+    std::cout << "Iterative walk on compact nodes: " << elapsed / (viewCount * repeats) << " us per view"
+              << (check == 0 ? "" : ", faces differ!") << std::endl;
+    useOcclusion = occlusionWas;
+}
+
+void Map::benchmarkOcclusion()
+{
+    const int viewCount = 256;
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::mat4> matrices;
+    std::vector<Frutsum> views;
+    if (nodeArray.empty() || !benchmarkViews(leafArray, viewCount, positions, matrices, views))
+        return;
+
+    std::cout << "Occlusion culling from " << viewCount << " views, " << occluderArray.size()
+              << " occluder candidates, " << OcclusionBuffer::Width << "x" << OcclusionBuffer::Height
+              << " buffer" << std::endl;
+
+    bool occlusionWas = useOcclusion;
+    bool parallelWas = useParallelCulling;
+    double drawTime[2] = {0.0, 0.0};
+    double cullTime[2] = {0.0, 0.0};
+    long long faces[2] = {0, 0};
+    long long occluders = 0;
+    long long occluded = 0;
+    for (int v = 0; v < viewCount; v++)
+    {
+        int leaf = findLeaf(positions[v]);
+        updateVisibility(leafArray[leaf].cluster, leafArray[leaf].area);
+
+        // Drawing the occluders on one thread and on all of them
+        for (int threads = 0; threads < 2; threads++)
+        {
+            useParallelCulling = threads == 1;
+            RenderPass pass(this, positions[v], matrices[v]);
+            stats = RenderStats();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            drawOccluders(pass);
+            drawTime[threads] += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        }
+        useParallelCulling = parallelWas;
+
+        for (int enabled = 0; enabled < 2; enabled++)
+        {
+            useOcclusion = enabled == 1;
+            RenderPass pass(this, positions[v], matrices[v]);
+            pass.cluster = leafArray[leaf].cluster;
+            stats = RenderStats();
+            opaqueList.items.clear();
+            transparentList.items.clear();
+            std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+            cullFaces(pass);
+            cullTime[enabled] += std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+            faces[enabled] += opaqueList.items.size() + transparentList.items.size();
+            if (enabled)
+            {
+                occluders += occlusion.polygonCount();
+                occluded += stats.occluded;
+            }
+        }
+    }
+    useOcclusion = occlusionWas;
+    stats = RenderStats();
+    opaqueList.items.clear();
+    transparentList.items.clear();
+    lastLeaf = -1;
+
+    std::cout << "Drawing occluders: " << drawTime[0] / viewCount << " us on one thread, "
+              << drawTime[1] / viewCount << " us on " << JobSystem::instance().workerCount() + 1
+              << ", " << occluders / double(viewCount) << " occluders per view" << std::endl;
+    std::cout << "Culling without occlusion: " << cullTime[0] / viewCount << " us, "
+              << faces[0] / double(viewCount) << " faces per view" << std::endl;
+    std::cout << "Culling with occlusion: " << cullTime[1] / viewCount << " us, "
+              << faces[1] / double(viewCount) << " faces per view, "
+              << occluded / double(viewCount) << " nodes, leaves and faces hidden" << std::endl;
+}
+
+void Map::benchmarkTraces()
+{
+    const int traceCount = 4096;
+    const float shortMove = 8.f;
+    const float longMove = 1024.f;
+    const float radius = 10.f;
+    const glm::vec3 boxMin(-15.f, -15.f, -24.f);
+    const glm::vec3 boxMax(15.f, 15.f, 32.f);
+
+    std::vector<glm::vec3> positions;
+    std::vector<glm::mat4> matrices;
+    std::vector<Frutsum> views;
+    if (nodeArray.empty() || !benchmarkViews(leafArray, traceCount, positions, matrices, views))
+        return;
+    std::vector<glm::vec3> directions(traceCount);
+    for (int i = 0; i < traceCount; i++)
+    {
+        glm::vec3 dir(rand() % 2001 - 1000, rand() % 2001 - 1000, rand() % 2001 - 1000);
+        directions[i] = glm::dot(dir, dir) > 0.f ? glm::normalize(dir) : glm::vec3(1.f, 0.f, 0.f);
+    }
+
+    std::cout << "Traces from " << traceCount << " random leaves, " << brushArray.size() << " brushes, "
+              << instanceArray.size() << " models" << std::endl;
+
+    // Pushing the sphere out of what it ends in, as traceWorld used to
+    std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+    int pushed = 0;
+    for (int i = 0; i < traceCount; i++)
+    {
+        glm::vec3 end = positions[i] + directions[i] * shortMove;
+        TracePass pass(this, end, positions[i], radius);
+        traceNode(0, pass);
+        traceInstances(pass);
+        pushed += pass.position != end;
+    }
+    double pushTime = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+
+    // Swept sphere and box over the same short moves and over long ones
+    double sweepTime[2][2] = {{0.0, 0.0}, {0.0, 0.0}};
+    int hits[2][2] = {{0, 0}, {0, 0}};
+    for (int length = 0; length < 2; length++)
+    {
+        float distance = length ? longMove : shortMove;
+        for (int shape = 0; shape < 2; shape++)
+        {
+            start = std::chrono::steady_clock::now();
+            for (int i = 0; i < traceCount; i++)
+            {
+                glm::vec3 end = positions[i] + directions[i] * distance;
+                TraceResult result = shape ? traceBox(positions[i], end, boxMin, boxMax)
+                                           : traceSphere(positions[i], end, radius);
+                hits[length][shape] += result.fraction < 1.f;
+            }
+            sweepTime[length][shape] = std::chrono::duration<double, std::micro>(std::chrono::steady_clock::now() - start).count();
+        }
+    }
+
+    std::cout << "Short moves (" << shortMove << " units): push out " << pushTime / traceCount << " us ("
+              << pushed << " pushed), swept sphere " << sweepTime[0][0] / traceCount << " us ("
+              << hits[0][0] << " hits), swept box " << sweepTime[0][1] / traceCount << " us ("
+              << hits[0][1] << " hits)" << std::endl;
+    std::cout << "Long moves (" << longMove << " units): swept sphere " << sweepTime[1][0] / traceCount << " us ("
+              << hits[1][0] << " hits), swept box " << sweepTime[1][1] / traceCount << " us ("
+              << hits[1][1] << " hits)" << std::endl;
+}
+
+void Map::traceBrush(int index, TracePass& pass)
+{
+    if (brushStampArray[index] == pass.stamp)
+        return;
+    brushStampArray[index] = pass.stamp;
     Brush& brush = brushArray[index];
     if (!shaderArray[brush.shader].solid)
         return;
@@ -802,35 +2728,412 @@ void Map::traceBrush(int index, TracePass& pass)
 
 void Map::traceNode(int index, TracePass& pass)
 {
-    if (index < 0)
+    traceStack.clear();
+    traceStack.push_back(index);
+    while (!traceStack.empty())
+    {
+        index = traceStack.back();
+        traceStack.pop_back();
+
+        if (index < 0)
+        {
+            Leaf& leaf = leafArray[~index];
+            for (int i = 0; i < leaf.brushCount; i++)
+            {
+                traceBrush(leafBrushArray[i + leaf.brushOffset], pass);
+            }
+            continue;
+        }
+
+        // Both sides are chosen before either is traced, the front side
+        // first, as the recursive walk did
+        const CompactNode& node = compactNodeArray[index];
+        float dist = glm::dot(node.normal, pass.position) - node.distance;
+
+        if (dist < pass.radius)
+        {
+            if (node.children[1] >= 0)
+                PREFETCH(&compactNodeArray[node.children[1]]);
+            traceStack.push_back(node.children[1]);
+        }
+
+        if (dist > -pass.radius)
+        {
+            traceStack.push_back(node.children[0]);
+        }
+    }
+}
+
+void Map::buildInstanceGrid()
+{
+    const Model& world = modelArray[0];
+    gridOrigin = world.min;
+    gridWidth = std::max(1, int(ceil((world.max.x - world.min.x) / INSTANCE_GRID_CELL)));
+    gridHeight = std::max(1, int(ceil((world.max.y - world.min.y) / INSTANCE_GRID_CELL)));
+
+    // Each cell's instances are counted into the entry after it, the counts
+    // are summed into where each cell starts and then the lists are filled
+    gridCellArray.assign(gridWidth * gridHeight + 1, 0);
+    for (size_t i = 0; i < instanceArray.size(); i++)
+    {
+        int x0, y0, x1, y1;
+        gridCells(instanceArray[i].min, instanceArray[i].max, x0, y0, x1, y1);
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+                gridCellArray[y * gridWidth + x + 1]++;
+        }
+    }
+    for (size_t i = 1; i < gridCellArray.size(); i++)
+        gridCellArray[i] += gridCellArray[i - 1];
+
+    gridInstanceArray.resize(gridCellArray.back());
+    std::vector<int> next(gridCellArray.begin(), gridCellArray.end() - 1);
+    for (size_t i = 0; i < instanceArray.size(); i++)
+    {
+        int x0, y0, x1, y1;
+        gridCells(instanceArray[i].min, instanceArray[i].max, x0, y0, x1, y1);
+        for (int y = y0; y <= y1; y++)
+        {
+            for (int x = x0; x <= x1; x++)
+                gridInstanceArray[next[y * gridWidth + x]++] = i;
+        }
+    }
+    gridDirty = false;
+}
+
+void Map::gridCells(const glm::vec3& min, const glm::vec3& max, int& x0, int& y0, int& x1, int& y1) const
+{
+    // Anything past the edge of the world is kept in the border cells
+    x0 = std::min(std::max(int(floor((min.x - gridOrigin.x) / INSTANCE_GRID_CELL)), 0), gridWidth - 1);
+    y0 = std::min(std::max(int(floor((min.y - gridOrigin.y) / INSTANCE_GRID_CELL)), 0), gridHeight - 1);
+    x1 = std::min(std::max(int(floor((max.x - gridOrigin.x) / INSTANCE_GRID_CELL)), 0), gridWidth - 1);
+    y1 = std::min(std::max(int(floor((max.y - gridOrigin.y) / INSTANCE_GRID_CELL)), 0), gridHeight - 1);
+}
+
+void Map::traceInstances(TracePass& pass)
+{
+    if (instanceArray.empty())
+        return;
+    if (gridDirty)
+        buildInstanceGrid();
+
+    glm::vec3 extent(pass.radius);
+    glm::vec3 min = glm::min(pass.position, pass.oldPosition) - extent;
+    glm::vec3 max = glm::max(pass.position, pass.oldPosition) + extent;
+    unsigned int stamp = nextGeneration(instanceStampArray, instanceGeneration);
+    int x0, y0, x1, y1;
+    gridCells(min, max, x0, y0, x1, y1);
+    for (int y = y0; y <= y1; y++)
+    {
+        for (int x = x0; x <= x1; x++)
+        {
+            int cell = y * gridWidth + x;
+            for (int i = gridCellArray[cell]; i < gridCellArray[cell + 1]; i++)
+            {
+                // Instances spanning several cells are listed in each
+                int index = gridInstanceArray[i];
+                if (instanceStampArray[index] == stamp)
+                    continue;
+                instanceStampArray[index] = stamp;
+
+                const ModelInstance& instance = instanceArray[index];
+                if (min.x > instance.max.x || min.y > instance.max.y || min.z > instance.max.z ||
+                    max.x < instance.min.x || max.y < instance.min.y || max.z < instance.min.z)
+                {
+                    continue;
+                }
+
+                const Model& model = modelArray[instance.model];
+                if (!instance.moved)
+                {
+                    for (int j = 0; j < model.brushCount; j++)
+                        traceBrush(model.brushOffset + j, pass);
+                    continue;
+                }
+
+                // The brush planes are in model space
+                TracePass local = pass;
+                local.position = glm::vec3(instance.inverse * glm::vec4(pass.position, 1.f));
+                local.oldPosition = glm::vec3(instance.inverse * glm::vec4(pass.oldPosition, 1.f));
+                for (int j = 0; j < model.brushCount; j++)
+                    traceBrush(model.brushOffset + j, local);
+                pass.position = glm::vec3(instance.transform * glm::vec4(local.position, 1.f));
+            }
+        }
+    }
+}
+
+bool Map::brushOverlaps(int index, const glm::vec3& min, const glm::vec3& max) const
+{
+    return min.x <= brushBounds.maxX[index] && max.x >= brushBounds.minX[index] &&
+           min.y <= brushBounds.maxY[index] && max.y >= brushBounds.minY[index] &&
+           min.z <= brushBounds.maxZ[index] && max.z >= brushBounds.minZ[index];
+}
+
+void Map::sweepBrush(int index, SweepPass& pass)
+{
+    if (brushStampArray[index] == pass.stamp)
+        return;
+    brushStampArray[index] = pass.stamp;
+    const Brush& brush = brushArray[index];
+    if (!shaderArray[brush.shader].solid || !brushOverlaps(index, pass.min, pass.max))
+        return;
+
+    // The sweep enters the brush at the last plane it crosses inwards and
+    // leaves it at the first it crosses outwards
+    float enterFraction = -1.f;
+    float leaveFraction = 1.f;
+    const BrushSide* enterSide = NULL;
+    bool startsOut = false;
+    bool endsOut = false;
+    for (int i = 0; i < brush.sideCount; i++)
+    {
+        const BrushSide& side = brushSideArray[brush.sideOffset + i];
+        const Plane& plane = planeArray[side.plane];
+        float dist = plane.distance + pass.offset(plane.normal);
+        float startDist = glm::dot(plane.normal, pass.start) - dist;
+        float endDist = glm::dot(plane.normal, pass.end) - dist;
+        if (startDist > 0.f)
+            startsOut = true;
+        if (endDist > 0.f)
+            endsOut = true;
+
+        // Entirely in front of this plane, so outside the brush
+        if (startDist > 0.f && (endDist >= SURFACE_CLIP_EPSILON || endDist >= startDist))
+            return;
+        if (startDist <= 0.f && endDist <= 0.f)
+            continue;
+
+        if (startDist > endDist)
+        {
+            float fraction = std::max((startDist - SURFACE_CLIP_EPSILON) / (startDist - endDist), 0.f);
+            if (fraction > enterFraction)
+            {
+                enterFraction = fraction;
+                enterSide = &side;
+            }
+        }
+        else
+        {
+            float fraction = std::min((startDist + SURFACE_CLIP_EPSILON) / (startDist - endDist), 1.f);
+            leaveFraction = std::min(leaveFraction, fraction);
+        }
+    }
+
+    if (!startsOut)
     {
-        Leaf& leaf = leafArray[~index];
-        for (int i = 0; i < leaf.brushCount; i++)
+        pass.result.startSolid = true;
+        if (!endsOut)
         {
-            traceBrush(leafBrushArray[i + leaf.brushOffset], pass);
+            pass.result.allSolid = true;
+            pass.result.fraction = 0.f;
+            pass.result.contents = shaderArray[brush.shader].contents;
         }
         return;
     }
 
-    Node& node = nodeArray[index];
-    Plane& plane = planeArray[node.plane];
-    float dist = glm::dot(plane.normal, pass.position) - plane.distance;
+    if (enterSide && enterFraction < leaveFraction && enterFraction < pass.result.fraction)
+    {
+        pass.result.fraction = std::max(enterFraction, 0.f);
+        pass.result.plane = planeArray[enterSide->plane];
+        pass.result.surface = shaderArray[enterSide->shader].surface;
+        pass.result.contents = shaderArray[brush.shader].contents;
+    }
+}
 
-    if (dist > -pass.radius)
+void Map::sweepTree(SweepPass& pass)
+{
+    sweepStack.clear();
+    SweepSegment whole = { 0, 0.f, 1.f, pass.start, pass.end };
+    sweepStack.push_back(whole);
+    while (!sweepStack.empty())
     {
-        traceNode(node.children[0], pass);
+        SweepSegment segment = sweepStack.back();
+        sweepStack.pop_back();
+
+        // Something nearer than this part of the sweep was already hit
+        if (pass.result.fraction <= segment.startFraction)
+            continue;
+
+        if (segment.node < 0)
+        {
+            const Leaf& leaf = leafArray[~segment.node];
+            for (int i = 0; i < leaf.brushCount; i++)
+                sweepBrush(leafBrushArray[leaf.brushOffset + i], pass);
+            continue;
+        }
+
+        // Only the sides of the node the swept shape reaches are visited,
+        // which clips the segment to the node's bounds on the way down
+        const CompactNode& node = compactNodeArray[segment.node];
+        float offset = pass.offset(node.normal);
+        float startDist = glm::dot(node.normal, segment.start) - node.distance;
+        float endDist = glm::dot(node.normal, segment.end) - node.distance;
+        if (startDist >= offset + 1.f && endDist >= offset + 1.f)
+        {
+            segment.node = node.children[0];
+            sweepStack.push_back(segment);
+            continue;
+        }
+        if (startDist < -offset - 1.f && endDist < -offset - 1.f)
+        {
+            segment.node = node.children[1];
+            sweepStack.push_back(segment);
+            continue;
+        }
+
+        // Split where the shape stops touching the side the segment starts
+        // on and where it starts touching the other one
+        int side = 0;
+        float nearFraction = 1.f;
+        float farFraction = 0.f;
+        if (startDist < endDist)
+        {
+            float scale = 1.f / (startDist - endDist);
+            side = 1;
+            farFraction = (startDist + offset + SURFACE_CLIP_EPSILON) * scale;
+            nearFraction = (startDist - offset + SURFACE_CLIP_EPSILON) * scale;
+        }
+        else if (startDist > endDist)
+        {
+            float scale = 1.f / (startDist - endDist);
+            farFraction = (startDist - offset - SURFACE_CLIP_EPSILON) * scale;
+            nearFraction = (startDist + offset + SURFACE_CLIP_EPSILON) * scale;
+        }
+        nearFraction = glm::clamp(nearFraction, 0.f, 1.f);
+        farFraction = glm::clamp(farFraction, 0.f, 1.f);
+
+        // The far side is pushed first so the near side is traced first
+        float span = segment.endFraction - segment.startFraction;
+        SweepSegment far = { node.children[side ^ 1], segment.startFraction + span * farFraction, segment.endFraction,
+                             glm::mix(segment.start, segment.end, farFraction), segment.end };
+        SweepSegment near = { node.children[side], segment.startFraction, segment.startFraction + span * nearFraction,
+                              segment.start, glm::mix(segment.start, segment.end, nearFraction) };
+        if (far.node >= 0)
+            PREFETCH(&compactNodeArray[far.node]);
+        sweepStack.push_back(far);
+        sweepStack.push_back(near);
     }
+}
+
+void Map::sweepInstances(SweepPass& pass)
+{
+    if (instanceArray.empty())
+        return;
+    if (gridDirty)
+        buildInstanceGrid();
 
-    if (dist < pass.radius)
+    unsigned int stamp = nextGeneration(instanceStampArray, instanceGeneration);
+    int x0, y0, x1, y1;
+    gridCells(pass.min, pass.max, x0, y0, x1, y1);
+    for (int y = y0; y <= y1; y++)
     {
-        traceNode(node.children[1], pass);
+        for (int x = x0; x <= x1; x++)
+        {
+            int cell = y * gridWidth + x;
+            for (int i = gridCellArray[cell]; i < gridCellArray[cell + 1]; i++)
+            {
+                int index = gridInstanceArray[i];
+                if (instanceStampArray[index] == stamp)
+                    continue;
+                instanceStampArray[index] = stamp;
+
+                const ModelInstance& instance = instanceArray[index];
+                if (pass.min.x > instance.max.x || pass.min.y > instance.max.y || pass.min.z > instance.max.z ||
+                    pass.max.x < instance.min.x || pass.max.y < instance.min.y || pass.max.z < instance.min.z)
+                {
+                    continue;
+                }
+
+                const Model& model = modelArray[instance.model];
+                if (!instance.moved)
+                {
+                    for (int j = 0; j < model.brushCount; j++)
+                        sweepBrush(model.brushOffset + j, pass);
+                    continue;
+                }
+
+                // The brushes are traced in model space. A box keeps its
+                // axes, as it does in Quake 3, so it only fits exactly when
+                // the model is not rotated.
+                SweepPass local = pass;
+                local.start = glm::vec3(instance.inverse * glm::vec4(pass.start, 1.f));
+                local.end = glm::vec3(instance.inverse * glm::vec4(pass.end, 1.f));
+                glm::vec3 grow = local.extent + glm::vec3(local.radius + 1.f);
+                local.min = glm::min(local.start, local.end) - grow;
+                local.max = glm::max(local.start, local.end) + grow;
+                for (int j = 0; j < model.brushCount; j++)
+                    sweepBrush(model.brushOffset + j, local);
+
+                if (local.result.allSolid || local.result.fraction < pass.result.fraction)
+                {
+                    glm::mat3 rotation(instance.transform);
+                    const Plane& plane = local.result.plane;
+                    pass.result = local.result;
+                    pass.result.plane.normal = rotation * plane.normal;
+                    pass.result.plane.distance = glm::dot(pass.result.plane.normal,
+                        glm::vec3(instance.transform * glm::vec4(plane.normal * plane.distance, 1.f)));
+                }
+                else if (local.result.startSolid)
+                {
+                    pass.result.startSolid = true;
+                }
+            }
+        }
     }
 }
 
+TraceResult Map::sweep(SweepPass& pass)
+{
+    if (!nodeArray.empty())
+        sweepTree(pass);
+    sweepInstances(pass);
+    pass.result.endPosition = glm::mix(pass.start, pass.end, pass.result.fraction);
+    return pass.result;
+}
+
+TraceResult Map::traceSphere(const glm::vec3& start, const glm::vec3& end, float radius)
+{
+    SweepPass pass(this, start, end, glm::vec3(0.f), radius);
+    return sweep(pass);
+}
+
+TraceResult Map::traceBox(const glm::vec3& start, const glm::vec3& end, const glm::vec3& min, const glm::vec3& max)
+{
+    // Swept as a box centred on the point traced
+    glm::vec3 centre = (min + max) * 0.5f;
+    SweepPass pass(this, start + centre, end + centre, (max - min) * 0.5f, 0.f);
+    TraceResult result = sweep(pass);
+    result.endPosition -= centre;
+    return result;
+}
+
 glm::vec3 Map::traceWorld(glm::vec3 pos, glm::vec3 oldPos, float radius)
 {
-    TracePass pass(this, pos, oldPos, radius);
-    traceNode(0, pass);
+    glm::vec3 start = oldPos;
+    glm::vec3 end = pos;
+    for (int i = 0; i < MAX_SLIDES; i++)
+    {
+        TraceResult result = traceSphere(start, end, radius);
+        if (result.startSolid)
+        {
+            TracePass pass(this, end, start, radius);
+            traceNode(0, pass);
+            traceInstances(pass);
+            return pass.position;
+        }
+        start = result.endPosition;
+        if (result.fraction >= 1.f)
+            break;
 
-    return pass.position;
+        // The rest of the move without the part into the plane
+        const glm::vec3& normal = result.plane.normal;
+        glm::vec3 remaining = end - start;
+        float into = glm::dot(remaining, normal);
+        if (into < 0.f)
+            remaining -= normal * into;
+        end = start + remaining;
+    }
+    return start;
 }
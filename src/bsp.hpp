@@ -1,15 +1,22 @@
 #ifndef BSP_HPP
 #define BSP_HPP
 
+#include <cstdint>
 #include <string>
+#include <utility>
 #include <vector>
-#include <map>
 #include <glm/glm.hpp>
 #include <GL/glew.h>
-#include <SFML/Graphics/Texture.hpp>
+#include "entity.hpp"
+#include "facecache.hpp"
+#include "fileindex.hpp"
 #include "frutsum.hpp"
+#include "occlusion.hpp"
+#include "renderstate.hpp"
+#include "texturecache.hpp"
 
 class Map;
+class IndirectRenderer;
 
 struct Plane {
     glm::vec3 normal;
@@ -23,6 +30,19 @@ struct Node {
     int max[3];
 };
 
+// Node as the traversals read it, with the splitting plane stored inline in
+// 32 bytes so a node never straddles more than two cache lines, and shares
+// one with its neighbour when the allocation is 32 byte aligned as it
+// usually is. Nodes are renumbered depth first on load, which puts the
+// front child of a node right after it in memory.
+struct CompactNode {
+    glm::vec3 normal;
+    float distance;
+    int children[2];
+    int parent;
+    int plane;
+};
+
 struct Leaf {
     int cluster;
     int area;
@@ -34,6 +54,14 @@ struct Leaf {
     int brushCount;
 };
 
+// Door between two areas. While it is closed nothing in one area is drawn
+// from the other unless another open portal connects them.
+struct AreaPortal {
+    int areas[2];
+    int model;
+    bool open;
+};
+
 struct Model {
     glm::vec3 min;
     glm::vec3 max;
@@ -43,6 +71,31 @@ struct Model {
     int brushCount;
 };
 
+// Inline model from modelArray[1..] placed in the world, such as a door or
+// a platform. Its faces are queued with the world's and its brushes are
+// traced after the world's. Moving it rewrites its vertices in place, so
+// the faces still draw in the same batches as everything else.
+struct ModelInstance {
+    int model;
+    // Rigid model space to world space transform
+    glm::mat4 transform;
+    glm::mat4 inverse;
+    bool moved;
+    // World space bounds and the leaves they touch
+    glm::vec3 min;
+    glm::vec3 max;
+    std::vector<int> leaves;
+    // How far a door moves to open, zero for everything else
+    glm::vec3 openOffset;
+    bool open;
+    // Vertices the faces use with their model space positions and normals,
+    // and the model space normal of each face
+    std::vector<int> vertices;
+    std::vector<glm::vec3> basePositions;
+    std::vector<glm::vec3> baseNormals;
+    std::vector<glm::vec3> baseFaceNormals;
+};
+
 struct Brush {
     int sideOffset;
     int sideCount;
@@ -94,26 +147,107 @@ struct LightVol {
     glm::vec3 direction;
 };
 
+// Potentially visible set, kept in the packed form it is stored in the
+// file. Row c holds one bit per cluster visible from cluster c, padded out
+// to whole 64-bit words.
 struct VisData {
     int clusterCount;
     int bytesPerCluster;
-    std::vector<bool> data;
+    int wordsPerCluster;
+    std::vector<uint64_t> words;
 };
 
 struct Shader {
     bool transparent;
     bool render;
     bool solid;
+    int surface;
+    int contents;
     std::string name;
-    sf::Texture texture;
+    GLuint texture;
+};
+
+// Large planar face that may be drawn into the occlusion buffer
+struct Occluder {
+    int face;
+    float area;
+};
+
+struct RenderItem {
+    GLuint texture;
+    GLuint lightMap;
+    // Squared distance from the camera to the face centroid
+    float depth;
+    int face;
+};
+
+struct Batch {
+    GLuint texture;
+    GLuint lightMap;
+    int indexOffset;
+    int indexCount;
+};
+
+// Faces of one pass and the batches built from them. Kept between frames so
+// an unchanged view can draw them again without rebuilding anything.
+struct DrawList {
+    std::vector<RenderItem> items;
+    std::vector<Batch> batches;
+    std::vector<GLuint> indices;
+    GLuint indexBuffer;
+
+    DrawList() : indexBuffer(0) {}
+};
+
+struct Subtree {
+    int node;
+    unsigned int planes;
+};
+
+// Faces found by culling one subtree of the BSP, in traversal order and
+// possibly listed more than once
+struct CullOutput {
+    std::vector<int> faces;
+    // Frustum planes each face's leaf straddles
+    std::vector<unsigned char> faceMasks;
+    int nodes;
+    int boxTests;
+    int occluded;
+    // Nodes still to visit, kept to avoid allocating every frame
+    std::vector<Subtree> stack;
+};
+
+struct RenderStats {
+    bool reused;
+    int nodes;
+    int boxTests;
+    int faces;
+    int backfaceCulled;
+    int frustumCulled;
+    int occluders;
+    // Nodes, leaves, models and faces hidden by the occluders
+    int occluded;
+    int models;
+    int drawCalls;
+    int textureBinds;
+
+    RenderStats() : reused(false), nodes(0), boxTests(0), faces(0), backfaceCulled(0), frustumCulled(0),
+                    occluders(0), occluded(0), models(0), drawCalls(0), textureBinds(0) {}
 };
 
 struct RenderPass {
     glm::vec3 pos;
     Frutsum frutsum;
+    // Matrix the frame is drawn with, frutsum may be wider
+    glm::mat4 matrix;
+    // Box the eye may move around in while the lists built by this pass are
+    // drawn, a face is only backfacing if it faces away from all of it
+    glm::vec3 eyeCentre;
+    glm::vec3 eyeExtent;
 
     int cluster;
-    std::vector<bool> renderedFaces;
+    // Faces carrying this stamp are already queued
+    unsigned int stamp;
 
     RenderPass(Map* parent, const glm::vec3 &position, const glm::mat4 &matrix);
 };
@@ -123,23 +257,94 @@ struct TracePass {
     glm::vec3 oldPosition;
     float radius;
 
-    std::vector<bool> tracedBrushes;
+    // Brushes carrying this stamp are already traced
+    unsigned int stamp;
 
     TracePass(Map* parent, const glm::vec3 &pos, const glm::vec3 &oldPos, float rad);
 };
 
+// What a swept trace hit. The end position is where the shape stops, a
+// little short of the plane it hit.
+struct TraceResult {
+    // 1 when nothing was hit
+    float fraction;
+    glm::vec3 endPosition;
+    Plane plane;
+    // Surface flags of the side hit and contents of its brush
+    int surface;
+    int contents;
+    // The shape starts inside a brush, or stays inside one all the way
+    bool startSolid;
+    bool allSolid;
+};
+
+// Box of half size extent grown by radius, swept from start to end. A
+// sphere has no extent and a box no radius. Brush planes are pushed out by
+// offset() so the shape can be traced as a point.
+struct SweepPass {
+    glm::vec3 start;
+    glm::vec3 end;
+    glm::vec3 extent;
+    float radius;
+    // Bounds of the whole sweep
+    glm::vec3 min;
+    glm::vec3 max;
+    TraceResult result;
+
+    // Brushes carrying this stamp are already traced
+    unsigned int stamp;
+
+    SweepPass(Map* parent, const glm::vec3 &start, const glm::vec3 &end, const glm::vec3 &extent, float radius);
+    float offset(const glm::vec3& normal) const;
+};
+
+// Part of a sweep left to trace through one node
+struct SweepSegment {
+    int node;
+    float startFraction;
+    float endFraction;
+    glm::vec3 start;
+    glm::vec3 end;
+};
+
 class Map
 {
 protected:
     GLuint program;
     GLuint vertexBuffer;
     GLuint meshIndexBuffer;
-    std::map<std::string, GLuint> programLoc;
+    GLint matrixLoc;
+    RenderState state;
+    IndirectRenderer* indirect;
+    bool useIndirect;
+    // Nothing is uploaded and no GL calls are made
+    bool headless;
     VisData visData;
+    int visCluster;
+    int visArea;
+    // Set when a portal opens or closes
+    bool areasChanged;
+    std::vector<uint64_t> visibleClusters;
+    std::vector<int> visibleLeafArray;
+    // Nodes with a visible leaf below them carry the current visFrame
+    unsigned int visFrame;
+    std::vector<unsigned int> nodeVisFrameArray;
+    std::vector<int> leafParentArray;
     int bezierLevel;
+    const FileIndex* fileIndex;
+    std::string cacheDir;
+    std::string mapFileName;
+    TextureCache textureCache;
+
+    std::vector<Entity> entityArray;
+    int areaCount;
+    std::vector<AreaPortal> areaPortalArray;
+    std::vector<unsigned char> areaVisibleArray;
+    std::vector<int> areaStack;
 
     std::vector<Plane> planeArray;
     std::vector<Node> nodeArray;
+    std::vector<CompactNode> compactNodeArray;
     std::vector<Leaf> leafArray;
     std::vector<int> leafFaceArray;
     std::vector<int> leafBrushArray;
@@ -150,17 +355,91 @@ protected:
     std::vector<GLuint> meshIndexArray;
     std::vector<Effect> effectArray;
     std::vector<Face> faceArray;
-    std::vector<sf::Texture> lightMapArray;
+    std::vector<GLuint> lightMapArray;
     std::vector<LightVol> lightVolArray;
     std::vector<Shader> shaderArray;
 
+    // Generation stamps that dedupe faces per frame and brushes per trace
+    // without clearing anything in between
+    std::vector<unsigned int> faceStampArray;
+    std::vector<unsigned int> brushStampArray;
+    unsigned int faceGeneration;
+    unsigned int brushGeneration;
+
+    // Bounds converted to floats once. Faces are tested in a batch per
+    // rebuild that fills faceInsideArray, nodes and leaves as the BSP walk
+    // reaches them.
+    BoundsArray nodeBounds;
+    BoundsArray leafBounds;
+    BoundsArray faceBounds;
+    std::vector<unsigned char> faceInsideArray;
+
+    // Culling runs on the job system over subtreeArray, submission stays on
+    // the GL thread
+    bool useParallelCulling;
+    std::vector<Subtree> subtreeArray;
+    std::vector<CullOutput> cullOutputArray;
+
+    // Nodes, leaves and faces behind the nearest large faces are dropped
+    // before they are queued
+    bool useOcclusion;
+    OcclusionBuffer occlusion;
+    std::vector<Occluder> occluderArray;
+    std::vector<std::pair<float, int> > occluderScoreArray;
+    std::vector<glm::vec3> faceCentroidArray;
+    // Planes of opaque planar faces, other faces have a zero normal and are
+    // never backfacing
+    std::vector<Plane> facePlaneArray;
+    FaceListCache faceCache;
+    bool useFaceCache;
+
+    std::vector<int> traceStack;
+    std::vector<SweepSegment> sweepStack;
+    // Bounds from the axial sides of each brush, other brushes are
+    // unbounded along the axes they have no side for
+    BoundsArray brushBounds;
+
+    // Inline models, and a grid over the world's floor plan listing the
+    // instances overlapping each cell so a trace only visits nearby ones.
+    // gridCellArray holds where each cell's list starts in
+    // gridInstanceArray, plus its end.
+    std::vector<ModelInstance> instanceArray;
+    std::vector<int> gridCellArray;
+    std::vector<int> gridInstanceArray;
+    glm::vec3 gridOrigin;
+    int gridWidth;
+    int gridHeight;
+    // Set when an instance moves
+    bool gridDirty;
+    std::vector<unsigned int> instanceStampArray;
+    unsigned int instanceGeneration;
+
+    DrawList opaqueList;
+    DrawList transparentList;
+    RenderStats stats;
+
+    bool useTemporal;
+    int lastLeaf;
+    glm::mat4 lastMatrix;
+    glm::mat4 lastViewMatrix;
+    glm::vec3 lastPos;
+
     unsigned int lightVolSizeX;
     unsigned int lightVolSizeY;
     unsigned int lightVolSizeZ;
 
     void tesselate(int controlOffset, int controlWidth, int vOffset, int iOffset);
 
-    bool clusterVisible(int test, int cam);
+    void updateVisibility(int cluster, int area);
+    void floodAreas(int area);
+    bool clusterVisible(int test) const;
+    bool leafVisible(const Leaf& leaf) const;
+    void boxLeaves(const glm::vec3& min, const glm::vec3& max, std::vector<int>& leaves) const;
+    void boxAreas(const glm::vec3& min, const glm::vec3& max, std::vector<int>& areas) const;
+    void findAreaPortals();
+    void findInstances();
+    void placeInstance(int index, const glm::mat4& transform);
+    void updateFaceBounds(int index);
     int findLeaf(glm::vec3 &pos);
     int findLeafCluster(glm::vec3 &pos);
     LightVol findLightVol(glm::vec3 &pos);
@@ -168,23 +447,101 @@ protected:
     void drawMesh(int faceIndex);
     void drawPatch(int faceIndex);
 
-    void renderFace(int index, RenderPass &pass, bool solid);
-    void renderNode(int index, RenderPass &pass, bool solid);
+    void buildFaceList(FaceList& faces);
+    void renderFaceList(const std::vector<int>& faces, RenderPass &pass);
+    bool faceBackfacing(int index, const RenderPass &pass) const;
+    void queueFace(int index, RenderPass &pass);
+    void drawOccluders(const RenderPass &pass);
+    void cullFaces(RenderPass &pass);
+    void cullInstances(RenderPass &pass);
+    void collectSubtrees(int index, RenderPass &pass, unsigned int planes, int depth);
+    void cullNode(int index, const RenderPass &pass, unsigned int planes, CullOutput &out) const;
+    void cullSubtrees(int begin, int end, const RenderPass &pass);
+    int walkNodeArray(const std::vector<Node> &nodes, const BoundsArray &bounds, const std::vector<unsigned int> &visFrames,
+                      int index, const Frutsum &frutsum, const glm::vec3 &pos, unsigned int planes) const;
+    void buildDrawList(DrawList& list, bool (*compare)(const RenderItem&, const RenderItem&));
+    void drawBatches(const DrawList& list);
 
     void traceBrush(int index, TracePass &pass);
     void traceNode(int index, TracePass &pass);
+    void buildInstanceGrid();
+    void gridCells(const glm::vec3& min, const glm::vec3& max, int& x0, int& y0, int& x1, int& y1) const;
+    void traceInstances(TracePass &pass);
+    bool brushOverlaps(int index, const glm::vec3& min, const glm::vec3& max) const;
+    void sweepBrush(int index, SweepPass &pass);
+    void sweepTree(SweepPass &pass);
+    void sweepInstances(SweepPass &pass);
+    TraceResult sweep(SweepPass &pass);
 
 public:
-    Map();
+    // A headless map needs no GL context. It loads everything culling and
+    // tracing use but no textures, and can be benchmarked but not drawn.
+    explicit Map(bool headless);
+    ~Map();
 
+    void setFileIndex(const FileIndex* index);
+    void setCacheDir(const std::string& dir);
     bool load(std::string fileName);
     void renderWorld(glm::mat4 matrix, glm::vec3 pos);
+    // Moves a sphere from oldPos towards pos, sliding along what it hits.
+    // One that starts inside a brush is pushed out of it instead.
     glm::vec3 traceWorld(glm::vec3 pos, glm::vec3 oldPos, float radius);
+    // Sweeps a sphere, or a box with min and max relative to its position,
+    // from start to end through the world and the inline models and stops
+    // at the first solid brush.
+    TraceResult traceSphere(const glm::vec3& start, const glm::vec3& end, float radius);
+    TraceResult traceBox(const glm::vec3& start, const glm::vec3& end, const glm::vec3& min, const glm::vec3& max);
+
+    // Switches between the GL 4.3 multi-draw-indirect renderer and the
+    // fallback path. Returns false if the former is not available.
+    bool setIndirectRendering(bool enabled);
+    bool indirectRendering() const;
+
+    // Faces come from per-cluster lists instead of a BSP walk
+    void setFaceCache(bool enabled);
+    bool faceCacheEnabled() const;
+    void setFaceCacheBudget(std::size_t bytes);
+
+    // Redraws the previous frame's lists while the view stays inside the
+    // widened frustum they were culled against
+    void setTemporalReuse(bool enabled);
+    bool temporalReuseEnabled() const;
+
+    void setParallelCulling(bool enabled);
+    bool parallelCullingEnabled() const;
+
+    void setOcclusionCulling(bool enabled);
+    bool occlusionCullingEnabled() const;
+
+    // Area portals are found from the doors in the entity lump, they start
+    // open if the door does. Opening or closing one moves its door.
+    int areaPortalCount() const;
+    bool areaPortalOpen(int portal) const;
+    void setAreaPortalOpen(int portal, bool open);
+
+    // Every func_ entity with an inline model is an instance of it
+    int modelInstanceCount() const;
+    void setModelTransform(int instance, const glm::mat4& transform);
+
+    void printStats() const;
+    // Times the batched frustum test against Frutsum::insideAABB on the
+    // nodes and leaves of the loaded map from a set of random views.
+    void benchmarkCulling();
+    // Times findLeaf and a full culling walk over the compact nodes against
+    // the same walks through the node and plane lumps.
+    void benchmarkTraversal();
+    // Times drawing the occluders and culling with and without them from
+    // the same views and counts what they hide.
+    void benchmarkOcclusion();
+    // Times swept sphere and box traces for short and long moves from
+    // random leaves against pushing a sphere out of the brushes it ends in.
+    void benchmarkTraces();
 
     friend struct Bezier;
     friend struct Patch;
     friend struct RenderPass;
     friend struct TracePass;
+    friend struct SweepPass;
 };
 
 #endif // BSP_HPP
@@ -0,0 +1,86 @@
+#include <cctype>
+#include <cstdlib>
+#include "entity.hpp"
+
+std::string Entity::value(const std::string& key) const
+{
+    for (size_t i = 0; i < pairs.size(); i++)
+    {
+        if (pairs[i].first == key)
+            return pairs[i].second;
+    }
+    return std::string();
+}
+
+int Entity::intValue(const std::string& key, int fallback) const
+{
+    std::string text = value(key);
+    return text.empty() ? fallback : atoi(text.c_str());
+}
+
+// Reads the next brace or quoted string, skipping white space and line
+// comments. Braces come back as a single character token.
+static bool nextToken(const std::string& text, size_t& pos, std::string& token, bool& quoted)
+{
+    while (pos < text.length())
+    {
+        if (isspace((unsigned char)text[pos]) || text[pos] == '\0')
+        {
+            pos++;
+        }
+        else if (text.compare(pos, 2, "//") == 0)
+        {
+            pos = text.find('\n', pos);
+            if (pos == std::string::npos)
+                pos = text.length();
+        }
+        else
+        {
+            break;
+        }
+    }
+    if (pos >= text.length())
+        return false;
+
+    quoted = text[pos] == '"';
+    if (!quoted)
+    {
+        token = text.substr(pos++, 1);
+        return true;
+    }
+
+    size_t end = text.find('"', pos + 1);
+    if (end == std::string::npos)
+        return false;
+    token = text.substr(pos + 1, end - pos - 1);
+    pos = end + 1;
+    return true;
+}
+
+bool parseEntities(const std::string& text, std::vector<Entity>& entities)
+{
+    size_t pos = 0;
+    std::string token;
+    bool quoted;
+    while (nextToken(text, pos, token, quoted))
+    {
+        if (quoted || token != "{")
+            return false;
+
+        Entity entity;
+        for (;;)
+        {
+            if (!nextToken(text, pos, token, quoted))
+                return false;
+            if (!quoted && token == "}")
+                break;
+
+            std::string key = token;
+            if (!quoted || !nextToken(text, pos, token, quoted) || !quoted)
+                return false;
+            entity.pairs.push_back(std::make_pair(key, token));
+        }
+        entities.push_back(entity);
+    }
+    return true;
+}
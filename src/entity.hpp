@@ -0,0 +1,22 @@
+#ifndef ENTITY_HPP
+#define ENTITY_HPP
+
+#include <string>
+#include <utility>
+#include <vector>
+
+// One block of key and value pairs from the entity lump, in file order
+struct Entity
+{
+    std::vector<std::pair<std::string, std::string> > pairs;
+
+    // Empty if the key is missing
+    std::string value(const std::string& key) const;
+    int intValue(const std::string& key, int fallback) const;
+};
+
+// Parses the text of the entity lump. Returns false if it is malformed,
+// the entities before the error are kept.
+bool parseEntities(const std::string& text, std::vector<Entity>& entities);
+
+#endif // ENTITY_HPP
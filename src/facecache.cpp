@@ -0,0 +1,106 @@
+#include "facecache.hpp"
+
+FaceListCache::FaceListCache(std::size_t budget)
+    : byteBudget(budget)
+    , bytes(0)
+    , hitCount(0)
+    , missCount(0)
+{
+}
+
+void FaceListCache::setBudget(std::size_t bytes)
+{
+    byteBudget = bytes;
+    evict(ages.empty() ? 0 : ages.front());
+}
+
+void FaceListCache::clear()
+{
+    entries.clear();
+    ages.clear();
+    bytes = 0;
+}
+
+const FaceList* FaceListCache::find(int cluster)
+{
+    std::unordered_map<int, Entry>::iterator i = entries.find(cluster);
+    if (i == entries.end())
+    {
+        missCount++;
+        return NULL;
+    }
+    hitCount++;
+    ages.splice(ages.begin(), ages, i->second.age);
+    return &i->second.faces;
+}
+
+const FaceList& FaceListCache::insert(int cluster, FaceList& faces)
+{
+    std::unordered_map<int, Entry>::iterator i = entries.find(cluster);
+    if (i != entries.end())
+    {
+        bytes -= entryMemory(i->second);
+        ages.erase(i->second.age);
+        entries.erase(i);
+    }
+
+    Entry& entry = entries[cluster];
+    entry.faces.opaque.swap(faces.opaque);
+    entry.faces.opaque.shrink_to_fit();
+    entry.faces.transparent.swap(faces.transparent);
+    entry.faces.transparent.shrink_to_fit();
+    ages.push_front(cluster);
+    entry.age = ages.begin();
+    bytes += entryMemory(entry);
+
+    evict(cluster);
+    return entry.faces;
+}
+
+std::size_t FaceListCache::budget() const
+{
+    return byteBudget;
+}
+
+std::size_t FaceListCache::memory() const
+{
+    return bytes;
+}
+
+std::size_t FaceListCache::size() const
+{
+    return entries.size();
+}
+
+unsigned int FaceListCache::hits() const
+{
+    return hitCount;
+}
+
+unsigned int FaceListCache::misses() const
+{
+    return missCount;
+}
+
+void FaceListCache::resetCounters()
+{
+    hitCount = 0;
+    missCount = 0;
+}
+
+std::size_t FaceListCache::entryMemory(const Entry& entry)
+{
+    std::size_t faces = entry.faces.opaque.capacity() + entry.faces.transparent.capacity();
+    return sizeof(Entry) + sizeof(int) + faces * sizeof(int);
+}
+
+void FaceListCache::evict(int keep)
+{
+    while (bytes > byteBudget && !ages.empty() && ages.back() != keep)
+    {
+        std::unordered_map<int, Entry>::iterator i = entries.find(ages.back());
+        bytes -= entryMemory(i->second);
+        entries.erase(i);
+        ages.pop_back();
+    }
+}
@@ -0,0 +1,58 @@
+#ifndef FACECACHE_HPP
+#define FACECACHE_HPP
+
+#include <cstddef>
+#include <list>
+#include <unordered_map>
+#include <vector>
+
+// Faces potentially visible from one cluster, split by blend state
+struct FaceList
+{
+    std::vector<int> opaque;
+    std::vector<int> transparent;
+};
+
+// Least recently used store of the candidate face lists for each camera
+// cluster. Lists are built by the caller on a miss and evicted oldest first
+// once the total size goes over the byte budget.
+class FaceListCache
+{
+public:
+    explicit FaceListCache(std::size_t budget);
+
+    void setBudget(std::size_t bytes);
+    void clear();
+
+    // Returns NULL on a miss. A hit makes the entry the most recent one.
+    const FaceList* find(int cluster);
+    // Takes the contents of faces. The new entry is never evicted by its
+    // own insertion, even if it alone is over budget.
+    const FaceList& insert(int cluster, FaceList& faces);
+
+    std::size_t budget() const;
+    std::size_t memory() const;
+    std::size_t size() const;
+    unsigned int hits() const;
+    unsigned int misses() const;
+    void resetCounters();
+
+private:
+    struct Entry
+    {
+        FaceList faces;
+        std::list<int>::iterator age;
+    };
+
+    static std::size_t entryMemory(const Entry& entry);
+    void evict(int keep);
+
+    std::unordered_map<int, Entry> entries;
+    std::list<int> ages;
+    std::size_t byteBudget;
+    std::size_t bytes;
+    unsigned int hitCount;
+    unsigned int missCount;
+};
+
+#endif // FACECACHE_HPP
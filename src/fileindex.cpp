@@ -0,0 +1,307 @@
+#include <algorithm>
+#include <cctype>
+#include <cstdio>
+#include <iostream>
+#include <sys/stat.h>
+#include <physfs.h>
+#include <zlib.h>
+#include "mappedfile.hpp"
+#include "fileindex.hpp"
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <dirent.h>
+#endif
+
+static std::string toKey(const std::string& path)
+{
+    std::string key = path;
+    size_t start = key.find_first_not_of('/');
+    key.erase(0, std::min(start, key.length()));
+    std::transform(key.begin(), key.end(), key.begin(), ::tolower);
+    return key;
+}
+
+static unsigned int readLE(const unsigned char* data, int bytes)
+{
+    unsigned int value = 0;
+    for (int i = bytes - 1; i >= 0; i--)
+        value = (value << 8) | data[i];
+    return value;
+}
+
+void FileIndex::build()
+{
+    entries.clear();
+    archives.clear();
+
+    // The search path is listed highest priority first, the first file
+    // added under a name wins just like it does for PHYSFS_openRead.
+    char** paths = PHYSFS_getSearchPath();
+    for (char** i = paths; *i != NULL; i++)
+    {
+        std::string path(*i);
+        int archive = archives.size();
+        archives.push_back(path);
+
+        struct stat info;
+        if (stat(path.c_str(), &info) != 0)
+            continue;
+        if ((info.st_mode & S_IFDIR) != 0)
+        {
+            indexDirectory(path, "", archive);
+        }
+        else if (!indexZip(path, archive, info.st_mtime))
+        {
+            std::cout << path << ": Unable to index archive" << std::endl;
+        }
+    }
+    PHYSFS_freeList(paths);
+}
+
+const FileIndex::Entry* FileIndex::find(const std::string& path) const
+{
+    std::unordered_map<std::string, Entry>::const_iterator i = entries.find(toKey(path));
+    if (i == entries.end())
+        return NULL;
+    return &i->second;
+}
+
+const FileIndex::Entry* FileIndex::resolve(const std::string& name, const char* const* extensions, int extensionCount) const
+{
+    std::string stem = toKey(name);
+    size_t dot = stem.find_last_of("./");
+    if (dot != std::string::npos && stem[dot] == '.')
+    {
+        std::string extension = stem.substr(dot);
+        for (int i = 0; i < extensionCount; i++)
+        {
+            if (extension == extensions[i])
+            {
+                stem.erase(dot);
+                break;
+            }
+        }
+    }
+
+    for (int i = 0; i < extensionCount; i++)
+    {
+        const Entry* entry = find(stem + extensions[i]);
+        if (entry)
+            return entry;
+    }
+    return find(name);
+}
+
+const std::string& FileIndex::archive(const Entry& entry) const
+{
+    return archives[entry.archive];
+}
+
+std::size_t FileIndex::size() const
+{
+    return entries.size();
+}
+
+bool FileIndex::read(const Entry& entry, std::vector<char>& data) const
+{
+    std::string dirsep = PHYSFS_getDirSeparator();
+    std::string native = archives[entry.archive];
+    bool directory = entry.method < 0;
+    if (directory)
+    {
+        if (native.length() >= dirsep.length() && native.substr(native.length() - dirsep.length()) == dirsep)
+            native.erase(native.length() - dirsep.length());
+        std::size_t start = 0;
+        while (start < entry.path.length())
+        {
+            std::size_t end = entry.path.find('/', start);
+            if (end == std::string::npos)
+                end = entry.path.length();
+            if (end > start)
+                native.append(dirsep).append(entry.path, start, end - start);
+            start = end + 1;
+        }
+    }
+
+    FILE* file = fopen(native.c_str(), "rb");
+    if (!file)
+        return false;
+
+    bool ok;
+    if (directory)
+    {
+        fseek(file, 0, SEEK_END);
+        long length = ftell(file);
+        fseek(file, 0, SEEK_SET);
+        ok = length >= 0;
+        if (ok)
+        {
+            data.resize(length);
+            ok = length == 0 || fread(&data[0], 1, length, file) == (std::size_t)length;
+        }
+        fclose(file);
+        return ok;
+    }
+
+    // The sizes come from the central directory, the local header's may
+    // be left zero when a data descriptor follows the data
+    unsigned char header[30];
+    ok = fseek(file, entry.offset, SEEK_SET) == 0 && fread(header, sizeof(header), 1, file) == 1 &&
+         readLE(header, 4) == 0x04034b50;
+    ok = ok && fseek(file, readLE(header + 26, 2) + readLE(header + 28, 2), SEEK_CUR) == 0;
+    std::vector<char> compressed;
+    if (ok)
+    {
+        compressed.resize(entry.compressedSize);
+        ok = entry.compressedSize == 0 || fread(&compressed[0], entry.compressedSize, 1, file) == 1;
+    }
+    fclose(file);
+    if (!ok)
+        return false;
+
+    if (entry.method == 0)
+    {
+        data.swap(compressed);
+        return data.size() == entry.size;
+    }
+    if (entry.method != 8)
+        return false;
+
+    // Raw deflate without a zlib header
+    data.resize(entry.size);
+    z_stream stream = z_stream();
+    if (inflateInit2(&stream, -MAX_WBITS) != Z_OK)
+        return false;
+    stream.next_in = reinterpret_cast<Bytef*>(compressed.empty() ? NULL : &compressed[0]);
+    stream.avail_in = compressed.size();
+    stream.next_out = reinterpret_cast<Bytef*>(data.empty() ? NULL : &data[0]);
+    stream.avail_out = data.size();
+    int status = inflate(&stream, Z_FINISH);
+    ok = status == Z_STREAM_END && stream.total_out == data.size();
+    inflateEnd(&stream);
+    return ok;
+}
+
+void FileIndex::addEntry(const Entry& entry)
+{
+    entries.insert(std::make_pair(toKey(entry.path), entry));
+}
+
+void FileIndex::addFile(const std::string& path, int archive, long long modTime)
+{
+    Entry entry;
+    entry.path = path;
+    entry.archive = archive;
+    entry.modTime = modTime;
+    entry.offset = 0;
+    entry.method = -1;
+    entry.compressedSize = 0;
+    entry.size = 0;
+    addEntry(entry);
+}
+
+bool FileIndex::indexZip(const std::string& path, int archive, long long modTime)
+{
+    MappedFile file;
+    if (!file.openNative(path) || file.size() < 22)
+        return false;
+
+    const unsigned char* data = reinterpret_cast<const unsigned char*>(file.data());
+    size_t size = file.size();
+
+    // The end of central directory record sits in the last 64k + 22 bytes
+    size_t end = size - 22;
+    size_t limit = size > 22 + 0xFFFF ? size - 22 - 0xFFFF : 0;
+    while (readLE(data + end, 4) != 0x06054b50)
+    {
+        if (end == limit)
+            return false;
+        end--;
+    }
+
+    unsigned int count = readLE(data + end + 10, 2);
+    size_t offset = readLE(data + end + 16, 4);
+    for (unsigned int i = 0; i < count; i++)
+    {
+        if (offset + 46 > size || readLE(data + offset, 4) != 0x02014b50)
+            return false;
+
+        size_t nameLength = readLE(data + offset + 28, 2);
+        size_t extraLength = readLE(data + offset + 30, 2);
+        size_t commentLength = readLE(data + offset + 32, 2);
+        if (offset + 46 + nameLength > size)
+            return false;
+
+        Entry entry;
+        entry.path.assign(reinterpret_cast<const char*>(data + offset + 46), nameLength);
+        entry.archive = archive;
+        entry.modTime = modTime;
+        entry.method = readLE(data + offset + 10, 2);
+        entry.compressedSize = readLE(data + offset + 20, 4);
+        entry.size = readLE(data + offset + 24, 4);
+        entry.offset = readLE(data + offset + 42, 4);
+        if (!entry.path.empty() && entry.path[entry.path.length() - 1] != '/')
+            addEntry(entry);
+
+        offset += 46 + nameLength + extraLength + commentLength;
+    }
+    return true;
+}
+
+void FileIndex::indexDirectory(const std::string& native, const std::string& prefix, int archive)
+{
+    std::string dirsep = PHYSFS_getDirSeparator();
+    std::string dir = native;
+    if (dir.length() >= dirsep.length() && dir.substr(dir.length() - dirsep.length()) == dirsep)
+        dir.erase(dir.length() - dirsep.length());
+
+#ifdef _WIN32
+    WIN32_FIND_DATAA found;
+    HANDLE handle = FindFirstFileA((dir + dirsep + "*").c_str(), &found);
+    if (handle == INVALID_HANDLE_VALUE)
+        return;
+    do
+    {
+        std::string name = found.cFileName;
+        if (name == "." || name == "..")
+            continue;
+        if (found.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            indexDirectory(dir + dirsep + name, prefix + name + "/", archive);
+        }
+        else
+        {
+            ULARGE_INTEGER time;
+            time.LowPart = found.ftLastWriteTime.dwLowDateTime;
+            time.HighPart = found.ftLastWriteTime.dwHighDateTime;
+            addFile(prefix + name, archive, time.QuadPart);
+        }
+    }
+    while (FindNextFileA(handle, &found));
+    FindClose(handle);
+#else
+    DIR* handle = opendir(dir.c_str());
+    if (!handle)
+        return;
+    while (dirent* found = readdir(handle))
+    {
+        std::string name = found->d_name;
+        if (name == "." || name == "..")
+            continue;
+
+        // PhysFS does not follow symbolic links by default
+        struct stat info;
+        std::string child = dir + dirsep + name;
+        if (lstat(child.c_str(), &info) != 0 || S_ISLNK(info.st_mode))
+            continue;
+
+        if (S_ISDIR(info.st_mode))
+            indexDirectory(child, prefix + name + "/", archive);
+        else
+            addFile(prefix + name, archive, info.st_mtime);
+    }
+    closedir(handle);
+#endif
+}
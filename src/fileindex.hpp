@@ -0,0 +1,55 @@
+#ifndef FILEINDEX_HPP
+#define FILEINDEX_HPP
+
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+// Case-insensitive lookup table of every file on the PhysFS search path,
+// built once after all archives are mounted. Pk3s are indexed from their
+// zip central directory and plain directories are walked natively, so
+// resolving a path no longer probes each mounted archive in turn. Files
+// found through the index are read straight from the archive they were
+// found in.
+class FileIndex
+{
+public:
+    struct Entry
+    {
+        std::string path;
+        int archive;
+        long long modTime;
+        // Where the zip local header is, how the data is stored and its
+        // size before and after compression. method is -1 for files in a
+        // plain directory.
+        std::size_t offset;
+        int method;
+        std::size_t compressedSize;
+        std::size_t size;
+    };
+
+    void build();
+
+    const Entry* find(const std::string& path) const;
+
+    // Finds name with any of the given extensions, in order of preference.
+    // An extension already present on name is ignored.
+    const Entry* resolve(const std::string& name, const char* const* extensions, int extensionCount) const;
+
+    // Reads the whole file, safe to call from several threads
+    bool read(const Entry& entry, std::vector<char>& data) const;
+
+    const std::string& archive(const Entry& entry) const;
+    std::size_t size() const;
+
+private:
+    void addEntry(const Entry& entry);
+    void addFile(const std::string& path, int archive, long long modTime);
+    bool indexZip(const std::string& path, int archive, long long modTime);
+    void indexDirectory(const std::string& native, const std::string& prefix, int archive);
+
+    std::unordered_map<std::string, Entry> entries;
+    std::vector<std::string> archives;
+};
+
+#endif // FILEINDEX_HPP
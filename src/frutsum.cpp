@@ -1,7 +1,23 @@
+#include <algorithm>
 #include <iostream>
 #include <glm/glm.hpp>
 #include "frutsum.hpp"
 
+// SSE is part of every x86-64 CPU, AVX is checked for at runtime. Both are
+// compiled per function so the rest of the build needs no extra flags.
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE__))
+#define FRUTSUM_X86
+#include <immintrin.h>
+#ifdef _MSC_VER
+#include <intrin.h>
+#define FRUTSUM_SSE_TARGET
+#define FRUTSUM_AVX_TARGET
+#else
+#define FRUTSUM_SSE_TARGET __attribute__((target("sse")))
+#define FRUTSUM_AVX_TARGET __attribute__((target("avx")))
+#endif
+#endif
+
 Frutsum::Frutsum(glm::mat4 matrix)
 {
     matrix = glm::transpose(matrix);
@@ -58,3 +74,262 @@ bool Frutsum::insideAABB(int *max, int *min)
 {
     return insideAABB(glm::vec3(max[0], max[1], max[2]), glm::vec3(min[0], min[1], min[2]));
 }
+
+Frutsum::Result Frutsum::classifyAABB(const glm::vec3& min, const glm::vec3& max, unsigned int& mask) const
+{
+    for (int i = 0; i < 6; i++)
+    {
+        unsigned int bit = 1u << i;
+        if (!(mask & bit))
+            continue;
+
+        // The corners furthest along and against the plane normal
+        glm::vec3 pVert = max;
+        glm::vec3 nVert = min;
+        if (planes[i].x < 0)
+        {
+            pVert.x = min.x;
+            nVert.x = max.x;
+        }
+        if (planes[i].y < 0)
+        {
+            pVert.y = min.y;
+            nVert.y = max.y;
+        }
+        if (planes[i].z < 0)
+        {
+            pVert.z = min.z;
+            nVert.z = max.z;
+        }
+
+        if (glm::dot(planes[i].xyz(), pVert) + planes[i].w <= 0)
+            return Outside;
+        if (glm::dot(planes[i].xyz(), nVert) + planes[i].w > 0)
+            mask &= ~bit;
+    }
+    return mask == 0 ? Inside : Intersect;
+}
+
+void BoundsArray::resize(std::size_t count)
+{
+    std::size_t padded = (count + Width - 1) / Width * Width;
+    minX.assign(padded, 0.f);
+    minY.assign(padded, 0.f);
+    minZ.assign(padded, 0.f);
+    maxX.assign(padded, 0.f);
+    maxY.assign(padded, 0.f);
+    maxZ.assign(padded, 0.f);
+}
+
+void BoundsArray::set(std::size_t index, const glm::vec3& min, const glm::vec3& max)
+{
+    minX[index] = min.x;
+    minY[index] = min.y;
+    minZ[index] = min.z;
+    maxX[index] = max.x;
+    maxY[index] = max.y;
+    maxZ[index] = max.z;
+}
+
+void BoundsArray::set(std::size_t index, const int* min, const int* max)
+{
+    set(index, glm::vec3(min[0], min[1], min[2]), glm::vec3(max[0], max[1], max[2]));
+}
+
+std::size_t BoundsArray::size() const
+{
+    return minX.size();
+}
+
+glm::vec3 BoundsArray::min(std::size_t index) const
+{
+    return glm::vec3(minX[index], minY[index], minZ[index]);
+}
+
+glm::vec3 BoundsArray::max(std::size_t index) const
+{
+    return glm::vec3(maxX[index], maxY[index], maxZ[index]);
+}
+
+// The kernels pick the box corner furthest along each plane normal with a
+// max instead of a branch: p.x * max.x is the larger product when p.x is
+// positive and p.x * min.x when it is negative, as in insideAABB.
+
+static void cullScalar(const glm::vec4* planes, const BoundsArray& bounds, std::size_t first, std::size_t end, unsigned char* results)
+{
+    for (std::size_t i = first; i < end; i++)
+    {
+        unsigned char inside = 1;
+        for (int j = 0; j < 6; j++)
+        {
+            const glm::vec4& plane = planes[j];
+            float distance = std::max(plane.x * bounds.minX[i], plane.x * bounds.maxX[i])
+                           + std::max(plane.y * bounds.minY[i], plane.y * bounds.maxY[i])
+                           + std::max(plane.z * bounds.minZ[i], plane.z * bounds.maxZ[i])
+                           + plane.w;
+            inside &= distance > 0.f;
+        }
+        results[i] = inside;
+    }
+}
+
+#ifdef FRUTSUM_X86
+
+FRUTSUM_SSE_TARGET
+static void cullSSE(const glm::vec4* planes, const BoundsArray& bounds, std::size_t first, std::size_t end, unsigned char* results)
+{
+    __m128 zero = _mm_setzero_ps();
+    for (std::size_t i = first; i < end; i += 4)
+    {
+        __m128 minX = _mm_loadu_ps(&bounds.minX[i]);
+        __m128 minY = _mm_loadu_ps(&bounds.minY[i]);
+        __m128 minZ = _mm_loadu_ps(&bounds.minZ[i]);
+        __m128 maxX = _mm_loadu_ps(&bounds.maxX[i]);
+        __m128 maxY = _mm_loadu_ps(&bounds.maxY[i]);
+        __m128 maxZ = _mm_loadu_ps(&bounds.maxZ[i]);
+
+        __m128 inside = _mm_castsi128_ps(_mm_set1_epi32(-1));
+        for (int j = 0; j < 6; j++)
+        {
+            __m128 x = _mm_set1_ps(planes[j].x);
+            __m128 y = _mm_set1_ps(planes[j].y);
+            __m128 z = _mm_set1_ps(planes[j].z);
+            __m128 distance = _mm_max_ps(_mm_mul_ps(x, minX), _mm_mul_ps(x, maxX));
+            distance = _mm_add_ps(distance, _mm_max_ps(_mm_mul_ps(y, minY), _mm_mul_ps(y, maxY)));
+            distance = _mm_add_ps(distance, _mm_max_ps(_mm_mul_ps(z, minZ), _mm_mul_ps(z, maxZ)));
+            distance = _mm_add_ps(distance, _mm_set1_ps(planes[j].w));
+            inside = _mm_and_ps(inside, _mm_cmpgt_ps(distance, zero));
+        }
+
+        int mask = _mm_movemask_ps(inside);
+        for (int k = 0; k < 4; k++)
+            results[i + k] = (mask >> k) & 1;
+    }
+}
+
+FRUTSUM_AVX_TARGET
+static void cullAVX(const glm::vec4* planes, const BoundsArray& bounds, std::size_t first, std::size_t end, unsigned char* results)
+{
+    __m256 zero = _mm256_setzero_ps();
+    for (std::size_t i = first; i < end; i += 8)
+    {
+        __m256 minX = _mm256_loadu_ps(&bounds.minX[i]);
+        __m256 minY = _mm256_loadu_ps(&bounds.minY[i]);
+        __m256 minZ = _mm256_loadu_ps(&bounds.minZ[i]);
+        __m256 maxX = _mm256_loadu_ps(&bounds.maxX[i]);
+        __m256 maxY = _mm256_loadu_ps(&bounds.maxY[i]);
+        __m256 maxZ = _mm256_loadu_ps(&bounds.maxZ[i]);
+
+        __m256 inside = _mm256_castsi256_ps(_mm256_set1_epi32(-1));
+        for (int j = 0; j < 6; j++)
+        {
+            __m256 x = _mm256_set1_ps(planes[j].x);
+            __m256 y = _mm256_set1_ps(planes[j].y);
+            __m256 z = _mm256_set1_ps(planes[j].z);
+            __m256 distance = _mm256_max_ps(_mm256_mul_ps(x, minX), _mm256_mul_ps(x, maxX));
+            distance = _mm256_add_ps(distance, _mm256_max_ps(_mm256_mul_ps(y, minY), _mm256_mul_ps(y, maxY)));
+            distance = _mm256_add_ps(distance, _mm256_max_ps(_mm256_mul_ps(z, minZ), _mm256_mul_ps(z, maxZ)));
+            distance = _mm256_add_ps(distance, _mm256_set1_ps(planes[j].w));
+            inside = _mm256_and_ps(inside, _mm256_cmp_ps(distance, zero, _CMP_GT_OQ));
+        }
+
+        int mask = _mm256_movemask_ps(inside);
+        for (int k = 0; k < 8; k++)
+            results[i + k] = (mask >> k) & 1;
+    }
+}
+
+static bool cpuHasAVX()
+{
+#ifdef _MSC_VER
+    int info[4];
+    __cpuid(info, 1);
+    bool osxsave = (info[2] & (1 << 27)) != 0;
+    bool avx = (info[2] & (1 << 28)) != 0;
+    return osxsave && avx && (_xgetbv(0) & 6) == 6;
+#else
+    return __builtin_cpu_supports("avx");
+#endif
+}
+
+#endif
+
+static Frutsum::Kernel bestKernel()
+{
+#ifdef FRUTSUM_X86
+    if (cpuHasAVX())
+        return Frutsum::AVX;
+    return Frutsum::SSE;
+#else
+    return Frutsum::Scalar;
+#endif
+}
+
+static Frutsum::Kernel currentKernel = bestKernel();
+
+void Frutsum::insideAABBs(const BoundsArray& bounds, unsigned char* results) const
+{
+    insideAABBs(bounds, 0, bounds.size(), results);
+}
+
+void Frutsum::insideAABBs(const BoundsArray& bounds, std::size_t first, std::size_t count, unsigned char* results) const
+{
+    std::size_t end = std::min(first + count, bounds.size());
+    switch (currentKernel)
+    {
+#ifdef FRUTSUM_X86
+    case AVX:
+        cullAVX(planes, bounds, first, end, results);
+        break;
+    case SSE:
+        cullSSE(planes, bounds, first, end, results);
+        break;
+#endif
+    default:
+        cullScalar(planes, bounds, first, end, results);
+        break;
+    }
+}
+
+Frutsum::Kernel Frutsum::kernel()
+{
+    return currentKernel;
+}
+
+bool Frutsum::setKernel(Kernel kernel)
+{
+    if (!kernelSupported(kernel))
+        return false;
+    currentKernel = kernel;
+    return true;
+}
+
+bool Frutsum::kernelSupported(Kernel kernel)
+{
+    switch (kernel)
+    {
+    case Scalar:
+        return true;
+#ifdef FRUTSUM_X86
+    case SSE:
+        return true;
+    case AVX:
+        return cpuHasAVX();
+#endif
+    default:
+        return false;
+    }
+}
+
+const char* Frutsum::kernelName(Kernel kernel)
+{
+    switch (kernel)
+    {
+    case SSE:
+        return "SSE";
+    case AVX:
+        return "AVX";
+    default:
+        return "scalar";
+    }
+}
@@ -1,18 +1,73 @@
 #ifndef FRUTSUM_HPP
 #define FRUTSUM_HPP
 
+#include <cstddef>
+#include <vector>
 #include <glm/glm.hpp>
 
+// Boxes stored as one array per coordinate so several can be tested at
+// once. The arrays are padded to a multiple of BoundsArray::Width.
+struct BoundsArray
+{
+    static const std::size_t Width = 8;
+
+    std::vector<float> minX, minY, minZ;
+    std::vector<float> maxX, maxY, maxZ;
+
+    void resize(std::size_t count);
+    void set(std::size_t index, const glm::vec3& min, const glm::vec3& max);
+    void set(std::size_t index, const int* min, const int* max);
+    std::size_t size() const;
+
+    glm::vec3 min(std::size_t index) const;
+    glm::vec3 max(std::size_t index) const;
+};
+
 class Frutsum
 {
 private:
     glm::vec4 planes[6];
 
 public:
+    enum Result
+    {
+        Outside,
+        Intersect,
+        Inside
+    };
+
+    static const unsigned int AllPlanes = 0x3f;
+
+    enum Kernel
+    {
+        Scalar,
+        SSE,
+        AVX
+    };
+
     Frutsum(glm::mat4 matrix);
     bool inside(glm::vec3 pos);
     bool insideAABB(glm::vec3 max, glm::vec3 min);
     bool insideAABB(int *max, int *min);
+
+    // Tests the box against the planes whose bits are set in mask and
+    // clears the bits of planes the box is entirely inside, so children of
+    // the box only need testing against the planes left in mask.
+    Result classifyAABB(const glm::vec3& min, const glm::vec3& max, unsigned int& mask) const;
+
+    // Writes 1 for every box of the array that is at least partly inside,
+    // 0 otherwise. results must hold bounds.size() entries.
+    void insideAABBs(const BoundsArray& bounds, unsigned char* results) const;
+    // Same for count boxes from first, which must be a multiple of
+    // BoundsArray::Width. results is indexed like the whole array.
+    void insideAABBs(const BoundsArray& bounds, std::size_t first, std::size_t count, unsigned char* results) const;
+
+    // The kernel used by insideAABBs, the fastest one the CPU supports
+    // unless another is set.
+    static Kernel kernel();
+    static bool setKernel(Kernel kernel);
+    static bool kernelSupported(Kernel kernel);
+    static const char* kernelName(Kernel kernel);
 };
 
 #endif // FRUTSUM_HPP
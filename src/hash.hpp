@@ -0,0 +1,18 @@
+#ifndef HASH_HPP
+#define HASH_HPP
+
+#include <string>
+
+// 64-bit FNV-1a, used to name cache files.
+inline unsigned long long hashString(const std::string& str)
+{
+    unsigned long long hash = 14695981039346656037ULL;
+    for (size_t i = 0; i < str.length(); i++)
+    {
+        hash ^= (unsigned char)str[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+}
+
+#endif // HASH_HPP
@@ -0,0 +1,407 @@
+#include <algorithm>
+#include <cstddef>
+#include <cstring>
+#include <iostream>
+#include "indirect.hpp"
+
+#include "indirectshaders.inc"
+
+static GLuint compileShader(GLenum type, const char* source)
+{
+    GLint status;
+    GLuint shader = glCreateShader(type);
+    glShaderSource(shader, 1, &source, NULL);
+    glCompileShader(shader);
+    glGetShaderiv(shader, GL_COMPILE_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        GLint length;
+        glGetShaderiv(shader, GL_INFO_LOG_LENGTH, &length);
+        char* log = new char[length + 1];
+        log[length] = '\0';
+        glGetShaderInfoLog(shader, length, &length, log);
+        std::cout << log << std::endl;
+        delete[] log;
+        glDeleteShader(shader);
+        return 0;
+    }
+    return shader;
+}
+
+static GLuint linkProgram(const char* vertSource, const char* fragSource)
+{
+    GLuint vertShader = compileShader(GL_VERTEX_SHADER, vertSource);
+    if (!vertShader)
+        return 0;
+    GLuint fragShader = compileShader(GL_FRAGMENT_SHADER, fragSource);
+    if (!fragShader)
+    {
+        glDeleteShader(vertShader);
+        return 0;
+    }
+
+    GLuint program = glCreateProgram();
+    glAttachShader(program, vertShader);
+    glAttachShader(program, fragShader);
+    glLinkProgram(program);
+    glDeleteShader(vertShader);
+    glDeleteShader(fragShader);
+
+    GLint status;
+    glGetProgramiv(program, GL_LINK_STATUS, &status);
+    if (status == GL_FALSE)
+    {
+        GLint length;
+        glGetProgramiv(program, GL_INFO_LOG_LENGTH, &length);
+        char* log = new char[length + 1];
+        log[length] = '\0';
+        glGetProgramInfoLog(program, length, &length, log);
+        std::cout << log << std::endl;
+        delete[] log;
+        glDeleteProgram(program);
+        return 0;
+    }
+    return program;
+}
+
+static void textureSize(GLuint texture, int& width, int& height, int& levels)
+{
+    GLint maxLevel;
+    glBindTexture(GL_TEXTURE_2D, texture);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_WIDTH, &width);
+    glGetTexLevelParameteriv(GL_TEXTURE_2D, 0, GL_TEXTURE_HEIGHT, &height);
+    glGetTexParameteriv(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, &maxLevel);
+    glBindTexture(GL_TEXTURE_2D, 0);
+    levels = maxLevel + 1;
+}
+
+IndirectRenderer::IndirectRenderer()
+    : program(0)
+    , matrixLoc(-1)
+    , vertexArray(0)
+    , layerBuffer(0)
+    , commandBuffer(0)
+    , lightMapTexture(0)
+    , persistent(false)
+    , mapped(NULL)
+    , capacity(0)
+    , frame(0)
+    , used(0)
+{
+    for (int i = 0; i < Frames; i++)
+        fences[i] = 0;
+}
+
+IndirectRenderer::~IndirectRenderer()
+{
+    for (int i = 0; i < Frames; i++)
+    {
+        if (fences[i])
+            glDeleteSync(fences[i]);
+    }
+    for (size_t i = 0; i < textureArrays.size(); i++)
+        glDeleteTextures(1, &textureArrays[i].texture);
+    if (lightMapTexture)
+        glDeleteTextures(1, &lightMapTexture);
+    // Deleting a mapped buffer unmaps it
+    if (commandBuffer)
+        glDeleteBuffers(1, &commandBuffer);
+    if (layerBuffer)
+        glDeleteBuffers(1, &layerBuffer);
+    if (vertexArray)
+        glDeleteVertexArrays(1, &vertexArray);
+    if (program)
+        glDeleteProgram(program);
+}
+
+bool IndirectRenderer::supported()
+{
+    return GLEW_VERSION_4_3 != 0;
+}
+
+bool IndirectRenderer::init(GLuint vertexBuffer, GLuint meshIndexBuffer, const std::vector<Shader>& shaders,
+                            const std::vector<GLuint>& lightMaps, const std::vector<Face>& faces)
+{
+    if (lightMaps.empty())
+        return false;
+
+    program = linkProgram(indirectVertSrc, indirectFragSrc);
+    if (!program)
+        return false;
+    matrixLoc = glGetUniformLocation(program, "matrix");
+
+    // Every drawable shader gets a layer in the array holding textures of
+    // its size. Shaders without a texture share a 1x1 layer.
+    GLint maxLayers;
+    glGetIntegerv(GL_MAX_ARRAY_TEXTURE_LAYERS, &maxLayers);
+
+    std::vector<int> shaderGroups(shaders.size(), -1);
+    std::vector<int> shaderLayers(shaders.size(), 0);
+    std::vector<std::vector<GLuint> > groupSources;
+    for (size_t i = 0; i < shaders.size(); i++)
+    {
+        if (!shaders[i].render)
+            continue;
+
+        int width = 1;
+        int height = 1;
+        int levels = 1;
+        if (shaders[i].texture)
+            textureSize(shaders[i].texture, width, height, levels);
+
+        size_t group = 0;
+        while (group < textureArrays.size())
+        {
+            const TextureArray& array = textureArrays[group];
+            if (array.width == width && array.height == height && array.levels == levels && array.layers < maxLayers)
+                break;
+            group++;
+        }
+        if (group == textureArrays.size())
+        {
+            TextureArray array;
+            array.texture = 0;
+            array.width = width;
+            array.height = height;
+            array.levels = levels;
+            array.layers = 0;
+            textureArrays.push_back(array);
+            groupSources.push_back(std::vector<GLuint>());
+        }
+
+        shaderGroups[i] = group;
+        shaderLayers[i] = textureArrays[group].layers++;
+        groupSources[group].push_back(shaders[i].texture);
+    }
+
+    for (size_t i = 0; i < textureArrays.size(); i++)
+    {
+        TextureArray& array = textureArrays[i];
+        array.texture = createArray(groupSources[i], array.width, array.height, array.levels);
+    }
+
+    int lightMapWidth, lightMapHeight, lightMapLevels;
+    textureSize(lightMaps[0], lightMapWidth, lightMapHeight, lightMapLevels);
+    lightMapTexture = createArray(lightMaps, lightMapWidth, lightMapHeight, lightMapLevels);
+
+    std::vector<GLint> layers(faces.size() * 2);
+    faceGroups.resize(faces.size());
+    faceCommands.resize(faces.size());
+    for (size_t i = 0; i < faces.size(); i++)
+    {
+        const Face& face = faces[i];
+        faceGroups[i] = shaderGroups[face.shader];
+        layers[i * 2 + 0] = shaderLayers[face.shader];
+        layers[i * 2 + 1] = face.lightMap;
+
+        Command& command = faceCommands[i];
+        command.count = face.meshIndexCount;
+        command.instanceCount = 1;
+        command.firstIndex = face.meshIndexOffset;
+        command.baseVertex = 0;
+        command.baseInstance = i;
+    }
+
+    glGenBuffers(1, &layerBuffer);
+    glBindBuffer(GL_ARRAY_BUFFER, layerBuffer);
+    glBufferData(GL_ARRAY_BUFFER, layers.size() * sizeof(GLint), layers.empty() ? NULL : &layers[0], GL_STATIC_DRAW);
+
+    glGenVertexArrays(1, &vertexArray);
+    glBindVertexArray(vertexArray);
+    glBindBuffer(GL_ARRAY_BUFFER, vertexBuffer);
+    glEnableVertexAttribArray(0);
+    glEnableVertexAttribArray(2);
+    glEnableVertexAttribArray(3);
+    glVertexAttribPointer(0, 3, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(long)offsetof(Vertex, position));
+    glVertexAttribPointer(2, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(long)offsetof(Vertex, texCoord));
+    glVertexAttribPointer(3, 2, GL_FLOAT, GL_FALSE, sizeof(Vertex), (void*)(long)offsetof(Vertex, lmCoord));
+    glBindBuffer(GL_ARRAY_BUFFER, layerBuffer);
+    glEnableVertexAttribArray(4);
+    glVertexAttribIPointer(4, 2, GL_INT, 0, NULL);
+    glVertexAttribDivisor(4, 1);
+    glBindBuffer(GL_ELEMENT_ARRAY_BUFFER, meshIndexBuffer);
+    glBindVertexArray(0);
+    glBindBuffer(GL_ARRAY_BUFFER, 0);
+
+    // A face is drawn at most once per frame, so one segment never needs
+    // more commands than there are faces.
+    capacity = std::max<int>(faces.size(), 1);
+    glGenBuffers(1, &commandBuffer);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    if (GLEW_VERSION_4_4 || GLEW_ARB_buffer_storage)
+    {
+        GLbitfield flags = GL_MAP_WRITE_BIT | GL_MAP_PERSISTENT_BIT | GL_MAP_COHERENT_BIT;
+        GLsizeiptr size = Frames * capacity * sizeof(Command);
+        glBufferStorage(GL_DRAW_INDIRECT_BUFFER, size, NULL, flags);
+        mapped = (Command*)glMapBufferRange(GL_DRAW_INDIRECT_BUFFER, 0, size, flags);
+        persistent = mapped != NULL;
+        if (!persistent)
+        {
+            // Storage is immutable, start over with a plain buffer
+            glDeleteBuffers(1, &commandBuffer);
+            glGenBuffers(1, &commandBuffer);
+        }
+    }
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+    return true;
+}
+
+GLuint IndirectRenderer::createArray(const std::vector<GLuint>& sources, int width, int height, int levels)
+{
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D_ARRAY, texture);
+    glTexStorage3D(GL_TEXTURE_2D_ARRAY, levels, GL_RGBA8, width, height, sources.size());
+
+    for (size_t layer = 0; layer < sources.size(); layer++)
+    {
+        if (!sources[layer])
+        {
+            // Sample black like the unbound texture the fallback path uses
+            static const unsigned char black[4] = {0, 0, 0, 255};
+            glTexSubImage3D(GL_TEXTURE_2D_ARRAY, 0, 0, 0, layer, 1, 1, 1, GL_RGBA, GL_UNSIGNED_BYTE, black);
+            continue;
+        }
+
+        for (int level = 0; level < levels; level++)
+        {
+            int levelWidth = std::max(width >> level, 1);
+            int levelHeight = std::max(height >> level, 1);
+            glCopyImageSubData(sources[layer], GL_TEXTURE_2D, level, 0, 0, 0,
+                               texture, GL_TEXTURE_2D_ARRAY, level, 0, 0, layer,
+                               levelWidth, levelHeight, 1);
+        }
+    }
+
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D_ARRAY, GL_TEXTURE_MIN_FILTER,
+        levels > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+    glBindTexture(GL_TEXTURE_2D_ARRAY, 0);
+    return texture;
+}
+
+void IndirectRenderer::begin(const glm::mat4& matrix, RenderState& state)
+{
+    // Wait until the GPU is done with the commands written into this
+    // segment three frames ago.
+    int segment = frame % Frames;
+    if (fences[segment])
+    {
+        GLenum result;
+        do
+            result = glClientWaitSync(fences[segment], GL_SYNC_FLUSH_COMMANDS_BIT, 1000000000);
+        while (result == GL_TIMEOUT_EXPIRED);
+        glDeleteSync(fences[segment]);
+        fences[segment] = 0;
+    }
+    used = 0;
+
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, commandBuffer);
+    if (!persistent)
+        glBufferData(GL_DRAW_INDIRECT_BUFFER, capacity * sizeof(Command), NULL, GL_STREAM_DRAW);
+    glBindVertexArray(vertexArray);
+
+    state.useProgram(program);
+    glUniformMatrix4fv(matrixLoc, 1, GL_FALSE, &matrix[0][0]);
+}
+
+void IndirectRenderer::draw(const std::vector<RenderItem>& queue, bool grouped, RenderState& state, RenderStats& stats)
+{
+    commandArray.clear();
+    drawArray.clear();
+
+    if (grouped)
+    {
+        // Counting sort by texture array, one draw per array
+        groupOffsets.assign(textureArrays.size() + 1, 0);
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            int group = faceGroups[queue[i].face];
+            if (group >= 0)
+                groupOffsets[group + 1]++;
+        }
+        for (size_t i = 0; i < textureArrays.size(); i++)
+        {
+            Draw draw;
+            draw.group = i;
+            draw.first = groupOffsets[i];
+            draw.count = groupOffsets[i + 1];
+            if (draw.count > 0)
+                drawArray.push_back(draw);
+            groupOffsets[i + 1] += groupOffsets[i];
+        }
+
+        commandArray.resize(groupOffsets.back());
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            int group = faceGroups[queue[i].face];
+            if (group >= 0)
+                commandArray[groupOffsets[group]++] = faceCommands[queue[i].face];
+        }
+    }
+    else
+    {
+        for (size_t i = 0; i < queue.size(); i++)
+        {
+            int group = faceGroups[queue[i].face];
+            if (group < 0)
+                continue;
+            if (drawArray.empty() || drawArray.back().group != group)
+            {
+                Draw draw;
+                draw.group = group;
+                draw.first = commandArray.size();
+                draw.count = 0;
+                drawArray.push_back(draw);
+            }
+            commandArray.push_back(faceCommands[queue[i].face]);
+            drawArray.back().count++;
+        }
+    }
+    stats.faces += queue.size();
+
+    submit(state, stats);
+}
+
+void IndirectRenderer::submit(RenderState& state, RenderStats& stats)
+{
+    if (commandArray.empty() || used + (int)commandArray.size() > capacity)
+        return;
+
+    int offset = used;
+    if (persistent)
+    {
+        offset += (frame % Frames) * capacity;
+        memcpy(mapped + offset, &commandArray[0], commandArray.size() * sizeof(Command));
+    }
+    else
+    {
+        glBufferSubData(GL_DRAW_INDIRECT_BUFFER, offset * sizeof(Command), commandArray.size() * sizeof(Command), &commandArray[0]);
+    }
+    used += commandArray.size();
+
+    if (state.bindTexture(3, lightMapTexture, GL_TEXTURE_2D_ARRAY))
+        stats.textureBinds++;
+    for (size_t i = 0; i < drawArray.size(); i++)
+    {
+        const Draw& draw = drawArray[i];
+        if (state.bindTexture(2, textureArrays[draw.group].texture, GL_TEXTURE_2D_ARRAY))
+            stats.textureBinds++;
+
+        glMultiDrawElementsIndirect(GL_TRIANGLES, GL_UNSIGNED_INT, (void*)(long)((offset + draw.first) * sizeof(Command)), draw.count, 0);
+        stats.drawCalls++;
+    }
+}
+
+void IndirectRenderer::end()
+{
+    if (persistent)
+        fences[frame % Frames] = glFenceSync(GL_SYNC_GPU_COMMANDS_COMPLETE, 0);
+    frame++;
+
+    glBindVertexArray(0);
+    glBindBuffer(GL_DRAW_INDIRECT_BUFFER, 0);
+}
@@ -0,0 +1,92 @@
+#ifndef INDIRECT_HPP
+#define INDIRECT_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+#include <GL/glew.h>
+#include "bsp.hpp"
+#include "renderstate.hpp"
+
+// GL 4.3 world renderer. The vertex layout lives in a VAO, surface textures
+// are copied into texture arrays grouped by size and the visible faces are
+// written as draw commands into an indirect buffer, so each pass costs one
+// glMultiDrawElementsIndirect per texture array. Each face draws as instance
+// baseInstance = face index, which picks its texture and lightmap layers
+// from a per-face attribute.
+class IndirectRenderer
+{
+public:
+    IndirectRenderer();
+    ~IndirectRenderer();
+
+    static bool supported();
+
+    // The map's textures and buffers must already be uploaded, they are
+    // referenced rather than copied except for the surface textures.
+    bool init(GLuint vertexBuffer, GLuint meshIndexBuffer, const std::vector<Shader>& shaders,
+              const std::vector<GLuint>& lightMaps, const std::vector<Face>& faces);
+
+    void begin(const glm::mat4& matrix, RenderState& state);
+    // Grouped queues may be reordered by texture array, otherwise the queue
+    // order is kept and only neighbours in the same array are merged.
+    void draw(const std::vector<RenderItem>& queue, bool grouped, RenderState& state, RenderStats& stats);
+    void end();
+
+private:
+    struct Command
+    {
+        GLuint count;
+        GLuint instanceCount;
+        GLuint firstIndex;
+        GLint baseVertex;
+        GLuint baseInstance;
+    };
+
+    struct TextureArray
+    {
+        GLuint texture;
+        int width;
+        int height;
+        int levels;
+        int layers;
+    };
+
+    struct Draw
+    {
+        int group;
+        int first;
+        int count;
+    };
+
+    static const int Frames = 3;
+
+    GLuint createArray(const std::vector<GLuint>& sources, int width, int height, int levels);
+    void submit(RenderState& state, RenderStats& stats);
+
+    GLuint program;
+    GLint matrixLoc;
+    GLuint vertexArray;
+    GLuint layerBuffer;
+    GLuint commandBuffer;
+    GLuint lightMapTexture;
+    std::vector<TextureArray> textureArrays;
+
+    std::vector<int> faceGroups;
+    std::vector<Command> faceCommands;
+
+    // The command buffer is split into one segment per frame in flight. When
+    // it can be persistently mapped the segments are written in place and
+    // guarded by fences, otherwise it is orphaned and refilled each frame.
+    bool persistent;
+    Command* mapped;
+    int capacity;
+    int frame;
+    int used;
+    GLsync fences[Frames];
+
+    std::vector<Command> commandArray;
+    std::vector<Draw> drawArray;
+    std::vector<int> groupOffsets;
+};
+
+#endif // INDIRECT_HPP
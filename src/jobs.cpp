@@ -0,0 +1,296 @@
+#include <algorithm>
+#include "jobs.hpp"
+
+// The pool and deque index of the calling thread, if it is a worker
+static thread_local JobSystem* currentSystem = NULL;
+static thread_local int currentWorker = -1;
+
+void JobSystem::Queue::push(const Job& job)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == jobs.size())
+    {
+        // Unroll into a larger buffer
+        std::vector<Job> grown(std::max<size_t>(jobs.size() * 2, 16));
+        for (size_t i = 0; i < count; i++)
+            grown[i].swap(jobs[(head + i) % jobs.size()]);
+        jobs.swap(grown);
+        head = 0;
+    }
+    jobs[(head + count) % jobs.size()] = job;
+    count++;
+}
+
+bool JobSystem::Queue::popBack(Job& job)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0)
+        return false;
+    count--;
+    job.swap(jobs[(head + count) % jobs.size()]);
+    jobs[(head + count) % jobs.size()] = nullptr;
+    return true;
+}
+
+bool JobSystem::Queue::popFront(Job& job)
+{
+    std::lock_guard<std::mutex> lock(mutex);
+    if (count == 0)
+        return false;
+    job.swap(jobs[head]);
+    jobs[head] = nullptr;
+    head = (head + 1) % jobs.size();
+    count--;
+    return true;
+}
+
+JobSystem::JobSystem(unsigned int workers)
+    : queued(0)
+    , stopping(false)
+{
+    if (workers < 1)
+        workers = 1;
+    // One deque per worker and a last one shared by every other thread
+    for (unsigned int i = 0; i <= workers; i++)
+        queues.push_back(std::unique_ptr<Queue>(new Queue()));
+    for (unsigned int i = 0; i < workers; i++)
+        threads.push_back(std::thread(&JobSystem::workerLoop, this, i));
+}
+
+JobSystem::~JobSystem()
+{
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+        stopping = true;
+    }
+    available.notify_all();
+    for (size_t i = 0; i < threads.size(); i++)
+        threads[i].join();
+}
+
+JobSystem& JobSystem::instance()
+{
+    // The calling thread helps while it waits, so leave it a core. The
+    // core count may be reported as 0 when it is unknown.
+    static JobSystem jobs(std::max(1u, std::thread::hardware_concurrency()) - 1);
+    return jobs;
+}
+
+void JobSystem::submit(const Job& job)
+{
+    int worker = currentSystem == this ? currentWorker : -1;
+    queues[worker >= 0 ? worker : queues.size() - 1]->push(job);
+    queued++;
+
+    // Taking the lock orders this against a worker checking queued before
+    // it goes to sleep, so the wakeup cannot be lost.
+    {
+        std::lock_guard<std::mutex> lock(sleepMutex);
+    }
+    available.notify_one();
+}
+
+bool JobSystem::runPending()
+{
+    Job job;
+    if (!take(currentSystem == this ? currentWorker : -1, job))
+        return false;
+    job();
+    return true;
+}
+
+void JobSystem::parallelFor(int count, int grain, const std::function<void(int, int)>& fn)
+{
+    if (grain < 1)
+        grain = 1;
+    int chunks = (count + grain - 1) / grain;
+    if (chunks <= 1)
+    {
+        if (count > 0)
+            fn(0, count);
+        return;
+    }
+
+    // Helpers claim chunks until none are left. The loop state lives on
+    // this stack frame, so every helper must have finished with it before
+    // returning, even one that starts after all chunks are done.
+    struct Loop
+    {
+        const std::function<void(int, int)>* fn;
+        int count;
+        int grain;
+        int chunks;
+        std::atomic<int> next;
+        std::atomic<int> active;
+
+        void run()
+        {
+            for (int chunk = next++; chunk < chunks; chunk = next++)
+            {
+                int begin = chunk * grain;
+                (*fn)(begin, std::min(begin + grain, count));
+            }
+        }
+    };
+
+    Loop loop;
+    loop.fn = &fn;
+    loop.count = count;
+    loop.grain = grain;
+    loop.chunks = chunks;
+    loop.next = 0;
+
+    int helpers = std::min<int>(chunks - 1, workerCount());
+    loop.active = helpers;
+    for (int i = 0; i < helpers; i++)
+    {
+        submit([&loop] {
+            loop.run();
+            loop.active--;
+        });
+    }
+
+    loop.run();
+    while (loop.active > 0)
+    {
+        if (!runPending())
+            std::this_thread::yield();
+    }
+}
+
+unsigned int JobSystem::workerCount() const
+{
+    // Not threads.size(), workers ask while the constructor still adds
+    return queues.size() - 1;
+}
+
+bool JobSystem::take(int worker, Job& job)
+{
+    size_t workers = workerCount();
+    bool found = (worker >= 0 && queues[worker]->popBack(job)) ||
+                 queues[workers]->popFront(job);
+    for (size_t i = 1; !found && i <= workers; i++)
+    {
+        size_t victim = (std::max(worker, 0) + i) % workers;
+        found = queues[victim]->popFront(job);
+    }
+    if (found)
+        queued--;
+    return found;
+}
+
+void JobSystem::workerLoop(int worker)
+{
+    currentSystem = this;
+    currentWorker = worker;
+    while (true)
+    {
+        Job job;
+        if (take(worker, job))
+        {
+            job();
+            continue;
+        }
+
+        std::unique_lock<std::mutex> lock(sleepMutex);
+        available.wait(lock, [this] { return stopping || queued > 0; });
+        if (stopping && queued == 0)
+            return;
+    }
+}
+
+TaskGraph::TaskGraph(JobSystem& jobs)
+    : jobs(jobs)
+    , finished(0)
+    , started(false)
+{
+}
+
+TaskGraph::~TaskGraph()
+{
+    if (started)
+        wait();
+}
+
+TaskGraph::Task TaskGraph::add(const std::function<void()>& fn)
+{
+    return add(fn, {});
+}
+
+TaskGraph::Task TaskGraph::add(const std::function<void()>& fn, std::initializer_list<Task> dependencies)
+{
+    Task task = nodes.size();
+    nodes.emplace_back();
+    Node& node = nodes.back();
+    node.fn = fn;
+    for (Task dependency : dependencies)
+    {
+        nodes[dependency].dependents.push_back(task);
+        node.dependencyCount++;
+    }
+    return task;
+}
+
+void TaskGraph::start()
+{
+    started = true;
+    for (size_t i = 0; i < nodes.size(); i++)
+        nodes[i].remaining = nodes[i].dependencyCount;
+    for (size_t i = 0; i < nodes.size(); i++)
+    {
+        if (nodes[i].dependencyCount == 0)
+            schedule(i);
+    }
+}
+
+void TaskGraph::wait(Task task)
+{
+    waitUntil([this, task] { return nodes[task].done; });
+}
+
+void TaskGraph::wait()
+{
+    waitUntil([this] { return finished == (int)nodes.size(); });
+}
+
+void TaskGraph::schedule(Task task)
+{
+    jobs.submit([this, task] { execute(task); });
+}
+
+void TaskGraph::execute(Task task)
+{
+    Node& node = nodes[task];
+    node.fn();
+
+    for (size_t i = 0; i < node.dependents.size(); i++)
+    {
+        Task dependent = node.dependents[i];
+        if (--nodes[dependent].remaining == 0)
+            schedule(dependent);
+    }
+
+    // Notify under the lock, a waiter may destroy the graph once it sees
+    // the last task finish.
+    std::lock_guard<std::mutex> lock(mutex);
+    node.done = true;
+    finished++;
+    changed.notify_all();
+}
+
+void TaskGraph::waitUntil(const std::function<bool()>& condition)
+{
+    while (true)
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            if (condition())
+                return;
+        }
+        if (!jobs.runPending())
+            break;
+    }
+
+    std::unique_lock<std::mutex> lock(mutex);
+    changed.wait(lock, condition);
+}
@@ -0,0 +1,114 @@
+#ifndef JOBS_HPP
+#define JOBS_HPP
+
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <initializer_list>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+// Pool of worker threads, each with its own job deque. Workers push and pop
+// at the back of their own deque and steal from the front of the others'
+// when it runs dry. Jobs submitted from other threads go to a shared deque.
+class JobSystem
+{
+public:
+    typedef std::function<void()> Job;
+
+    explicit JobSystem(unsigned int workers);
+    ~JobSystem();
+
+    // Shared pool sized to the machine, created on first use.
+    static JobSystem& instance();
+
+    void submit(const Job& job);
+
+    // Runs one queued job on the calling thread, returns false if none.
+    bool runPending();
+
+    // Calls fn(begin, end) for consecutive ranges of at most grain items
+    // covering [0, count), on the workers and the calling thread. Returns
+    // once every range is done.
+    void parallelFor(int count, int grain, const std::function<void(int, int)>& fn);
+
+    unsigned int workerCount() const;
+
+private:
+    JobSystem(const JobSystem&);
+    JobSystem& operator=(const JobSystem&);
+
+    // Ring buffer, so steady use does not allocate
+    struct Queue
+    {
+        std::mutex mutex;
+        std::vector<Job> jobs;
+        size_t head;
+        size_t count;
+
+        Queue() : head(0), count(0) {}
+        void push(const Job& job);
+        bool popBack(Job& job);
+        bool popFront(Job& job);
+    };
+
+    bool take(int worker, Job& job);
+    void workerLoop(int worker);
+
+    std::vector<std::thread> threads;
+    std::vector<std::unique_ptr<Queue> > queues;
+    std::atomic<int> queued;
+    std::mutex sleepMutex;
+    std::condition_variable available;
+    bool stopping;
+};
+
+// A set of tasks with explicit dependencies. Tasks are handed to the job
+// system as soon as everything they depend on has finished. Waiting threads
+// help out by running queued jobs.
+class TaskGraph
+{
+public:
+    typedef int Task;
+
+    explicit TaskGraph(JobSystem& jobs);
+    ~TaskGraph();
+
+    Task add(const std::function<void()>& fn);
+    Task add(const std::function<void()>& fn, std::initializer_list<Task> dependencies);
+
+    void start();
+    void wait(Task task);
+    void wait();
+
+private:
+    TaskGraph(const TaskGraph&);
+    TaskGraph& operator=(const TaskGraph&);
+
+    struct Node
+    {
+        std::function<void()> fn;
+        std::vector<Task> dependents;
+        int dependencyCount;
+        std::atomic<int> remaining;
+        bool done;
+
+        Node() : dependencyCount(0), remaining(0), done(false) {}
+    };
+
+    void schedule(Task task);
+    void execute(Task task);
+    void waitUntil(const std::function<bool()>& condition);
+
+    JobSystem& jobs;
+    std::deque<Node> nodes;
+    int finished;
+    bool started;
+    std::mutex mutex;
+    std::condition_variable changed;
+};
+
+#endif // JOBS_HPP
@@ -1,9 +1,13 @@
+#include <cstdlib>
 #include <iostream>
+#include <string>
+#include <vector>
 #include <physfs.h>
 #include <GL/glew.h>
 #include <glm/glm.hpp>
 #include <glm/gtc/matrix_transform.hpp>
 #include <SFML/Window.hpp>
+#include "alloccount.hpp"
 #include "bsp.hpp"
 
 #define PI 3.14159265359f
@@ -13,17 +17,57 @@ inline float deg2rad(float deg)
     return deg * PI / 180.f;
 }
 
+static bool loadMap(Map& map, const FileIndex& index, bool useCache, int faceCacheSize, const std::string& path)
+{
+    map.setFileIndex(&index);
+    if (useCache)
+    {
+        // Precompiled maps and decoded textures are kept in ~/.bspviewer/cache
+        std::string dirsep = PHYSFS_getDirSeparator();
+        std::string cacheDir = PHYSFS_getUserDir();
+        if (PHYSFS_setWriteDir(cacheDir.c_str()) && PHYSFS_mkdir(".bspviewer/cache"))
+        {
+            cacheDir.append(".bspviewer").append(dirsep).append("cache");
+            map.setCacheDir(cacheDir);
+        }
+        else
+        {
+            std::cout << "Cache disabled: " << PHYSFS_getLastError() << std::endl;
+        }
+    }
+    if (faceCacheSize >= 0)
+        map.setFaceCacheBudget((std::size_t)faceCacheSize * 1024 * 1024);
+    return map.load(path);
+}
+
 int main(int argc, char *argv[])
 {
-    if (argc < 2 || argc > 3)
+    bool useCache = true;
+    bool benchmark = false;
+    int faceCacheSize = -1;
+    std::vector<std::string> args;
+    for (int i = 1; i < argc; i++)
     {
-        std::cout << "Usage: bspviewer [Q3DataPath [Map]]" << std::endl;
+        std::string arg(argv[i]);
+        if (arg == "-nocache")
+            useCache = false;
+        else if (arg == "-benchmark")
+            benchmark = true;
+        else if (arg == "-facecache" && i + 1 < argc)
+            faceCacheSize = atoi(argv[++i]);
+        else
+            args.push_back(arg);
+    }
+
+    if (args.size() < 1 || args.size() > 2)
+    {
+        std::cout << "Usage: bspviewer [-nocache] [-facecache MB] [-benchmark] [Q3DataPath [Map]]" << std::endl;
         return -1;
     }
 
     PHYSFS_init(argv[0]);
 
-    if (!PHYSFS_mount(argv[1], NULL, 0))
+    if (!PHYSFS_mount(args[0].c_str(), NULL, 0))
     {
         std::cout << "Path not found" << std::endl;
         return -1;
@@ -45,7 +89,7 @@ int main(int argc, char *argv[])
     }
     PHYSFS_freeList(files);
 
-    if (argc == 2)
+    if (args.size() == 1)
     {
         char** files = PHYSFS_enumerateFiles("/maps/");
         for (char** i = files; *i != NULL; i++)
@@ -60,8 +104,29 @@ int main(int argc, char *argv[])
         return 0;
     }
 
+    FileIndex index;
+    index.build();
+
+    // The benchmarks only time work done on the CPU, so they run before any
+    // window or GL context exists
+    if (benchmark)
+    {
+        Map map(true);
+        if (!loadMap(map, index, useCache, faceCacheSize, args[1]))
+            return -1;
+        map.benchmarkCulling();
+        map.benchmarkTraversal();
+        map.benchmarkOcclusion();
+        map.benchmarkTraces();
+        return 0;
+    }
+
     sf::ContextSettings settings;
     settings.depthBits = 24;
+    // 4.3 enables the multi-draw-indirect renderer, older contexts still
+    // work with the fallback path.
+    settings.majorVersion = 4;
+    settings.minorVersion = 3;
 
     int width = 800;
     int height = 600;
@@ -70,8 +135,8 @@ int main(int argc, char *argv[])
 
     glewInit();
 
-    Map map;
-    if (!map.load(argv[2]))
+    Map map(false);
+    if (!loadMap(map, index, useCache, faceCacheSize, args[1]))
     {
         return -1;
     }
@@ -84,6 +149,7 @@ int main(int argc, char *argv[])
     float yaw = 0.f;
     float pitch = 0.f;
     bool collision = false;
+    unsigned long long frameAllocations = 0;
 
     while (window.isOpen())
     {
@@ -112,9 +178,40 @@ int main(int argc, char *argv[])
             case sf::Event::KeyPressed:
                 switch (event.key.code)
                 {
+                case sf::Keyboard::C:
+                    map.setFaceCache(!map.faceCacheEnabled());
+                    break;
                 case sf::Keyboard::E:
                     collision = !collision;
                     break;
+                case sf::Keyboard::F:
+                {
+                    // Opens every door's portal if any is closed, closes them otherwise
+                    bool open = false;
+                    for (int i = 0; i < map.areaPortalCount(); i++)
+                        open = open || !map.areaPortalOpen(i);
+                    for (int i = 0; i < map.areaPortalCount(); i++)
+                        map.setAreaPortalOpen(i, open);
+                    break;
+                }
+                case sf::Keyboard::G:
+                    if (!map.setIndirectRendering(!map.indirectRendering()))
+                        std::cout << "Multi-draw-indirect renderer needs OpenGL 4.3" << std::endl;
+                    break;
+                case sf::Keyboard::J:
+                    map.setParallelCulling(!map.parallelCullingEnabled());
+                    break;
+                case sf::Keyboard::O:
+                    map.setOcclusionCulling(!map.occlusionCullingEnabled());
+                    break;
+                case sf::Keyboard::P:
+                    map.printStats();
+                    if (allocationsCounted())
+                        std::cout << "Heap allocations: " << frameAllocations << std::endl;
+                    break;
+                case sf::Keyboard::T:
+                    map.setTemporalReuse(!map.temporalReuseEnabled());
+                    break;
                 case sf::Keyboard::Escape:
                     window.close();
                     break;
@@ -149,6 +246,9 @@ int main(int argc, char *argv[])
         if (sf::Keyboard::isKeyPressed(sf::Keyboard::LShift))
             position -= up * elapsed * speed;
 
+        // Collision and rendering should not touch the heap once warmed up
+        unsigned long long allocations = allocationCount();
+
         if (collision)
             position = map.traceWorld(position, oldPos, 10.f);
 
@@ -161,6 +261,7 @@ int main(int argc, char *argv[])
         view = glm::translate(view, -position);
 
         map.renderWorld(view, position);
+        frameAllocations = allocationCount() - allocations;
 
         window.display();
     }
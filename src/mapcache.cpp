@@ -0,0 +1,186 @@
+#include <atomic>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <physfs.h>
+#include "hash.hpp"
+#include "mapcache.hpp"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+const int CACHE_VERSION = 2;
+
+static std::atomic<unsigned int> tempCount(0);
+
+enum
+{
+    CACHE_SOURCE = 0,
+    CACHE_VERTEX,
+    CACHE_MESHINDEX,
+    CACHE_FACE,
+    CACHE_LIGHTVOL,
+    CACHE_SECTIONS
+};
+
+struct CacheSection
+{
+    unsigned long long offset;
+    unsigned long long size;
+};
+
+struct CacheHeader
+{
+    char magic[4];
+    int version;
+    int bezierLevel;
+    int lightMapAtlasSize;
+    int vertexSize;
+    int faceSize;
+    int lightVolSize;
+    unsigned long long sourceSize;
+    long long sourceModTime;
+    CacheSection sections[CACHE_SECTIONS];
+};
+
+template <typename T>
+static bool sectionView(const MappedFile& file, const CacheHeader& header, int section, ArrayView<T>& out)
+{
+    const CacheSection& info = header.sections[section];
+    if (info.size % sizeof(T) != 0)
+        return false;
+    return file.view(info.offset, info.size, out);
+}
+
+MapCache::MapCache(const std::string& directory, const std::string& source, std::size_t sourceSize, long long sourceModTime,
+                   int bezierLevel, int lightMapAtlasSize)
+    : source(source)
+    , sourceSize(sourceSize)
+    , sourceModTime(sourceModTime)
+    , bezierLevel(bezierLevel)
+    , lightMapAtlasSize(lightMapAtlasSize)
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.bspc", hashString(source));
+    path = directory + PHYSFS_getDirSeparator() + name;
+}
+
+bool MapCache::open()
+{
+    if (!file.openNative(path))
+        return false;
+    if (!validate())
+    {
+        file.close();
+        return false;
+    }
+    return true;
+}
+
+bool MapCache::validate()
+{
+    ArrayView<CacheHeader> headerView;
+    if (!file.view(0, sizeof(CacheHeader), headerView) || headerView.empty())
+        return false;
+
+    const CacheHeader& header = headerView[0];
+    if (std::string(header.magic, 4) != "BSPC" ||
+        header.version != CACHE_VERSION ||
+        header.bezierLevel != bezierLevel ||
+        header.lightMapAtlasSize != lightMapAtlasSize ||
+        header.vertexSize != sizeof(Vertex) ||
+        header.faceSize != sizeof(Face) ||
+        header.lightVolSize != sizeof(LightVol) ||
+        header.sourceSize != sourceSize ||
+        header.sourceModTime != sourceModTime)
+    {
+        return false;
+    }
+
+    ArrayView<char> sourceName;
+    if (!sectionView(file, header, CACHE_SOURCE, sourceName) ||
+        std::string(sourceName.begin(), sourceName.end()) != source)
+    {
+        return false;
+    }
+
+    return sectionView(file, header, CACHE_VERTEX, vertices) &&
+           sectionView(file, header, CACHE_MESHINDEX, meshIndices) &&
+           sectionView(file, header, CACHE_FACE, faces) &&
+           sectionView(file, header, CACHE_LIGHTVOL, lightVols);
+}
+
+bool MapCache::write(const std::vector<Vertex>& vertices, const std::vector<GLuint>& meshIndices,
+                     const std::vector<Face>& faces, const std::vector<LightVol>& lightVols) const
+{
+    const void* data[CACHE_SECTIONS] = {
+        source.data(),
+        vertices.empty() ? NULL : &vertices[0],
+        meshIndices.empty() ? NULL : &meshIndices[0],
+        faces.empty() ? NULL : &faces[0],
+        lightVols.empty() ? NULL : &lightVols[0]
+    };
+
+    CacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BSPC", 4);
+    header.version = CACHE_VERSION;
+    header.bezierLevel = bezierLevel;
+    header.lightMapAtlasSize = lightMapAtlasSize;
+    header.vertexSize = sizeof(Vertex);
+    header.faceSize = sizeof(Face);
+    header.lightVolSize = sizeof(LightVol);
+    header.sourceSize = sourceSize;
+    header.sourceModTime = sourceModTime;
+    header.sections[CACHE_SOURCE].size = source.length();
+    header.sections[CACHE_VERTEX].size = vertices.size() * sizeof(Vertex);
+    header.sections[CACHE_MESHINDEX].size = meshIndices.size() * sizeof(GLuint);
+    header.sections[CACHE_FACE].size = faces.size() * sizeof(Face);
+    header.sections[CACHE_LIGHTVOL].size = lightVols.size() * sizeof(LightVol);
+
+    // Sections are 16 byte aligned so they can be viewed in place
+    unsigned long long offset = sizeof(CacheHeader);
+    for (int i = 0; i < CACHE_SECTIONS; i++)
+    {
+        offset = (offset + 15) & ~15ULL;
+        header.sections[i].offset = offset;
+        offset += header.sections[i].size;
+    }
+
+    // Write to a temporary file first so a crash never leaves a truncated
+    // cache behind that looks valid. Several viewers can build the same
+    // cache at once, so each writer gets its own temporary file.
+    std::ostringstream name;
+    name << path << "." << getpid() << "." << tempCount++ << ".tmp";
+    std::string temp = name.str();
+    FILE* out = fopen(temp.c_str(), "wb");
+    if (!out)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    unsigned long long position = sizeof(CacheHeader);
+    for (int i = 0; ok && i < CACHE_SECTIONS; i++)
+    {
+        static const char padding[16] = {0};
+        unsigned long long pad = header.sections[i].offset - position;
+        if (pad > 0)
+            ok = fwrite(padding, pad, 1, out) == 1;
+        if (ok && header.sections[i].size > 0)
+            ok = fwrite(data[i], header.sections[i].size, 1, out) == 1;
+        position = header.sections[i].offset + header.sections[i].size;
+    }
+    ok = (fclose(out) == 0) && ok;
+
+    if (ok)
+    {
+        remove(path.c_str());
+        ok = rename(temp.c_str(), path.c_str()) == 0;
+    }
+    if (!ok)
+        remove(temp.c_str());
+    return ok;
+}
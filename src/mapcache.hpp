@@ -0,0 +1,40 @@
+#ifndef MAPCACHE_HPP
+#define MAPCACHE_HPP
+
+#include <string>
+#include <vector>
+#include "mappedfile.hpp"
+#include "bsp.hpp"
+
+// Precompiled copy of the derived map data (tessellated vertices, rebased
+// mesh indices, converted faces and the decoded light grid). The file is
+// keyed on the source path, size and modification time and is memory mapped
+// on load, so a warm start skips all per-element work.
+class MapCache
+{
+public:
+    MapCache(const std::string& directory, const std::string& source, std::size_t sourceSize, long long sourceModTime,
+             int bezierLevel, int lightMapAtlasSize);
+
+    bool open();
+    bool write(const std::vector<Vertex>& vertices, const std::vector<GLuint>& meshIndices,
+               const std::vector<Face>& faces, const std::vector<LightVol>& lightVols) const;
+
+    ArrayView<Vertex> vertices;
+    ArrayView<GLuint> meshIndices;
+    ArrayView<Face> faces;
+    ArrayView<LightVol> lightVols;
+
+private:
+    bool validate();
+
+    std::string path;
+    std::string source;
+    std::size_t sourceSize;
+    long long sourceModTime;
+    int bezierLevel;
+    int lightMapAtlasSize;
+    MappedFile file;
+};
+
+#endif // MAPCACHE_HPP
@@ -0,0 +1,167 @@
+#include <cstdio>
+#include <sys/stat.h>
+#include <physfs.h>
+#include "mappedfile.hpp"
+
+#if defined(__unix__) || defined(__APPLE__)
+#define MAPPEDFILE_MMAP
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#endif
+
+static bool isNativeDirectory(const std::string& path)
+{
+    struct stat info;
+    if (stat(path.c_str(), &info) != 0)
+        return false;
+    return (info.st_mode & S_IFDIR) != 0;
+}
+
+MappedFile::MappedFile()
+    : bytes(NULL)
+    , bytesSize(0)
+    , mapping(NULL)
+{
+}
+
+MappedFile::~MappedFile()
+{
+    close();
+}
+
+bool MappedFile::open(const std::string& path)
+{
+    close();
+
+    const char* realDir = PHYSFS_getRealDir(path.c_str());
+    if (realDir && isNativeDirectory(realDir))
+    {
+        std::string dirsep = PHYSFS_getDirSeparator();
+        std::string native = realDir;
+        if (native.length() >= dirsep.length() && native.substr(native.length() - dirsep.length()) == dirsep)
+            native.erase(native.length() - dirsep.length());
+        std::size_t start = 0;
+        while (start < path.length())
+        {
+            std::size_t end = path.find('/', start);
+            if (end == std::string::npos)
+                end = path.length();
+            if (end > start)
+                native.append(dirsep).append(path, start, end - start);
+            start = end + 1;
+        }
+        if (openNative(native))
+            return true;
+    }
+
+    PHYSFS_File* file = PHYSFS_openRead(path.c_str());
+    if (!file)
+        return false;
+
+    PHYSFS_sint64 length = PHYSFS_fileLength(file);
+    if (length < 0)
+    {
+        PHYSFS_close(file);
+        return false;
+    }
+
+    buffer.resize(length);
+    if (length > 0 && PHYSFS_read(file, &buffer[0], 1, length) != length)
+    {
+        PHYSFS_close(file);
+        buffer.clear();
+        return false;
+    }
+    PHYSFS_close(file);
+
+    bytes = buffer.empty() ? NULL : &buffer[0];
+    bytesSize = buffer.size();
+    return true;
+}
+
+bool MappedFile::openNative(const std::string& path)
+{
+    close();
+
+#ifdef MAPPEDFILE_MMAP
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0)
+        return false;
+
+    struct stat info;
+    if (fstat(fd, &info) != 0)
+    {
+        ::close(fd);
+        return false;
+    }
+
+    if (info.st_size > 0)
+    {
+        void* address = mmap(NULL, info.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (address == MAP_FAILED)
+        {
+            ::close(fd);
+            return false;
+        }
+        mapping = address;
+        bytes = static_cast<const char*>(address);
+        bytesSize = info.st_size;
+    }
+    ::close(fd);
+    return true;
+#else
+    FILE* file = fopen(path.c_str(), "rb");
+    if (!file)
+        return false;
+
+    fseek(file, 0, SEEK_END);
+    long length = ftell(file);
+    fseek(file, 0, SEEK_SET);
+    if (length < 0)
+    {
+        fclose(file);
+        return false;
+    }
+
+    buffer.resize(length);
+    if (length > 0 && fread(&buffer[0], 1, length, file) != (std::size_t)length)
+    {
+        fclose(file);
+        buffer.clear();
+        return false;
+    }
+    fclose(file);
+
+    bytes = buffer.empty() ? NULL : &buffer[0];
+    bytesSize = buffer.size();
+    return true;
+#endif
+}
+
+void MappedFile::close()
+{
+#ifdef MAPPEDFILE_MMAP
+    if (mapping)
+        munmap(mapping, bytesSize);
+#endif
+    mapping = NULL;
+    bytes = NULL;
+    bytesSize = 0;
+    std::vector<char>().swap(buffer);
+}
+
+bool MappedFile::isMapped() const
+{
+    return mapping != NULL;
+}
+
+const char* MappedFile::data() const
+{
+    return bytes;
+}
+
+std::size_t MappedFile::size() const
+{
+    return bytesSize;
+}
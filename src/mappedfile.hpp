@@ -0,0 +1,63 @@
+#ifndef MAPPEDFILE_HPP
+#define MAPPEDFILE_HPP
+
+#include <cstddef>
+#include <string>
+#include <vector>
+
+template <typename T>
+struct ArrayView
+{
+    const T* data;
+    std::size_t count;
+
+    ArrayView() : data(NULL), count(0) {}
+    ArrayView(const T* d, std::size_t c) : data(d), count(c) {}
+
+    const T& operator[](std::size_t index) const { return data[index]; }
+    const T* begin() const { return data; }
+    const T* end() const { return data + count; }
+    std::size_t size() const { return count; }
+    bool empty() const { return count == 0; }
+};
+
+// Holds the whole contents of a file from the PhysFS search path in memory.
+// Files that live in a plain directory are memory mapped, files inside an
+// archive are read with a single PHYSFS_read call.
+class MappedFile
+{
+public:
+    MappedFile();
+    ~MappedFile();
+
+    bool open(const std::string& path);
+    bool openNative(const std::string& path);
+    void close();
+
+    bool isMapped() const;
+    const char* data() const;
+    std::size_t size() const;
+
+    // Returns false if the range is outside the file or misaligned for T.
+    template <typename T>
+    bool view(std::size_t offset, std::size_t length, ArrayView<T>& out) const
+    {
+        if (offset > bytesSize || length > bytesSize - offset)
+            return false;
+        if ((reinterpret_cast<std::size_t>(bytes) + offset) % alignof(T) != 0)
+            return false;
+        out = ArrayView<T>(reinterpret_cast<const T*>(bytes + offset), length / sizeof(T));
+        return true;
+    }
+
+private:
+    MappedFile(const MappedFile&);
+    MappedFile& operator=(const MappedFile&);
+
+    const char* bytes;
+    std::size_t bytesSize;
+    std::vector<char> buffer;
+    void* mapping;
+};
+
+#endif // MAPPEDFILE_HPP
@@ -0,0 +1,297 @@
+#include <algorithm>
+#include <cmath>
+#include <limits>
+#include "jobs.hpp"
+#include "occlusion.hpp"
+
+// SSE is part of every x86-64 CPU, so no runtime check is needed here
+#if defined(__x86_64__) || defined(_M_X64) || (defined(__i386__) && defined(__SSE__))
+#define OCCLUSION_SSE
+#include <xmmintrin.h>
+#endif
+
+const float FAR_DEPTH = std::numeric_limits<float>::max();
+
+OcclusionBuffer::OcclusionBuffer()
+    : empty(true)
+{
+    for (int i = 0; i < Levels; i++)
+        levels[i].assign((Width >> i) * (Height >> i), FAR_DEPTH);
+}
+
+void OcclusionBuffer::begin(const glm::mat4& matrix)
+{
+    this->matrix = matrix;
+    polygonArray.clear();
+    edgeArray.clear();
+    empty = true;
+}
+
+void OcclusionBuffer::addPolygon(const glm::vec3* corners, int count)
+{
+    // Clipping can add a corner
+    if (count < 3 || count >= MaxCorners)
+        return;
+
+    // Clip against the near plane, z >= -w
+    glm::vec4 in[MaxCorners];
+    for (int i = 0; i < count; i++)
+        in[i] = matrix * glm::vec4(corners[i], 1.f);
+
+    glm::vec4 out[MaxCorners];
+    int clipped = 0;
+    for (int i = 0; i < count; i++)
+    {
+        const glm::vec4& current = in[i];
+        const glm::vec4& next = in[(i + 1) % count];
+        float currentDist = current.z + current.w;
+        float nextDist = next.z + next.w;
+        if (currentDist >= 0.f)
+            out[clipped++] = current;
+        if ((currentDist >= 0.f) != (nextDist >= 0.f))
+            out[clipped++] = current + (next - current) * (currentDist / (currentDist - nextDist));
+    }
+
+    if (clipped >= 3)
+        addProjected(out, clipped);
+}
+
+void OcclusionBuffer::addProjected(const glm::vec4* corners, int count)
+{
+    float x[MaxCorners], y[MaxCorners], z[MaxCorners];
+    Polygon polygon;
+    polygon.minX = polygon.minY = FAR_DEPTH;
+    polygon.maxX = polygon.maxY = -FAR_DEPTH;
+    float area = 0.f;
+    for (int i = 0; i < count; i++)
+    {
+        const glm::vec4& p = corners[i];
+        if (p.w <= 0.f)
+            return;
+        x[i] = (p.x / p.w * 0.5f + 0.5f) * Width;
+        y[i] = (p.y / p.w * 0.5f + 0.5f) * Height;
+        z[i] = p.z / p.w;
+        polygon.minX = std::min(polygon.minX, x[i]);
+        polygon.maxX = std::max(polygon.maxX, x[i]);
+        polygon.minY = std::min(polygon.minY, y[i]);
+        polygon.maxY = std::max(polygon.maxY, y[i]);
+    }
+    for (int i = 0; i < count; i++)
+    {
+        int j = (i + 1) % count;
+        area += x[i] * y[j] - x[j] * y[i];
+    }
+
+    // Too thin to cover a whole texel, or off screen
+    if (std::fabs(area) < 1.f)
+        return;
+    if (polygon.maxX < 0.f || polygon.maxY < 0.f || polygon.minX >= Width || polygon.minY >= Height)
+        return;
+
+    // Depth plane from the largest triangle of the fan, raised to the
+    // farthest depth inside each texel
+    int best = 1;
+    float bestArea = 0.f;
+    for (int i = 1; i + 1 < count; i++)
+    {
+        float triangleArea = std::fabs((x[i] - x[0]) * (y[i + 1] - y[0]) - (x[i + 1] - x[0]) * (y[i] - y[0]));
+        if (triangleArea > bestArea)
+        {
+            best = i;
+            bestArea = triangleArea;
+        }
+    }
+    int b = best;
+    int c = best + 1;
+    float planeArea = (x[b] - x[0]) * (y[c] - y[0]) - (x[c] - x[0]) * (y[b] - y[0]);
+    polygon.dzdx = ((z[b] - z[0]) * (y[c] - y[0]) - (z[c] - z[0]) * (y[b] - y[0])) / planeArea;
+    polygon.dzdy = ((z[c] - z[0]) * (x[b] - x[0]) - (z[b] - z[0]) * (x[c] - x[0])) / planeArea;
+    polygon.dz = z[0] - polygon.dzdx * x[0] - polygon.dzdy * y[0] +
+                 0.5f * (std::fabs(polygon.dzdx) + std::fabs(polygon.dzdy));
+
+    // Edges are moved in by half a texel so only texels entirely inside
+    // pass the test at their centre
+    float sign = area > 0.f ? 1.f : -1.f;
+    polygon.firstEdge = edgeArray.size();
+    for (int i = 0; i < count; i++)
+    {
+        int j = (i + 1) % count;
+        Edge edge;
+        edge.a = sign * (y[i] - y[j]);
+        edge.b = sign * (x[j] - x[i]);
+        if (edge.a == 0.f && edge.b == 0.f)
+            continue;
+        edge.c = -(edge.a * x[i] + edge.b * y[i]) - 0.5f * (std::fabs(edge.a) + std::fabs(edge.b));
+        edgeArray.push_back(edge);
+    }
+    polygon.edgeCount = edgeArray.size() - polygon.firstEdge;
+    polygonArray.push_back(polygon);
+}
+
+void OcclusionBuffer::rasterize(bool parallel)
+{
+    empty = polygonArray.empty();
+    if (empty)
+        return;
+
+    int bands = Height / BandHeight;
+    if (parallel)
+    {
+        JobSystem::instance().parallelFor(bands, 1, [this](int begin, int end) {
+            rasterizeBands(begin, end);
+        });
+    }
+    else
+    {
+        rasterizeBands(0, bands);
+    }
+    buildLevels();
+}
+
+void OcclusionBuffer::rasterizeBands(int first, int last)
+{
+    std::vector<float>& depth = levels[0];
+    int firstRow = first * BandHeight;
+    int lastRow = last * BandHeight - 1;
+    std::fill(depth.begin() + firstRow * Width, depth.begin() + (lastRow + 1) * Width, FAR_DEPTH);
+
+    for (size_t p = 0; p < polygonArray.size(); p++)
+    {
+        const Polygon& polygon = polygonArray[p];
+        int x0 = std::max(0, (int)std::floor(polygon.minX));
+        int x1 = std::min(Width - 1, (int)std::floor(polygon.maxX));
+        int y0 = std::max(firstRow, (int)std::floor(polygon.minY));
+        int y1 = std::min(lastRow, (int)std::floor(polygon.maxY));
+        if (x0 > x1 || y0 > y1)
+            continue;
+
+        const Edge* edges = &edgeArray[polygon.firstEdge];
+        int edgeCount = polygon.edgeCount;
+        for (int y = y0; y <= y1; y++)
+        {
+            float centreY = y + 0.5f;
+            float* row = &depth[y * Width];
+#ifdef OCCLUSION_SSE
+            // Four texels at a time from a multiple of four, the texels left
+            // of the bounds fail the edge tests
+            int start = x0 & ~3;
+            __m128 centreX = _mm_add_ps(_mm_set1_ps(start + 0.5f), _mm_set_ps(3.f, 2.f, 1.f, 0.f));
+            __m128 edgeValue[MaxCorners];
+            __m128 edgeStep[MaxCorners];
+            for (int i = 0; i < edgeCount; i++)
+            {
+                edgeValue[i] = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(edges[i].a), centreX),
+                                          _mm_set1_ps(edges[i].b * centreY + edges[i].c));
+                edgeStep[i] = _mm_set1_ps(edges[i].a * 4.f);
+            }
+            __m128 z = _mm_add_ps(_mm_mul_ps(_mm_set1_ps(polygon.dzdx), centreX),
+                                  _mm_set1_ps(polygon.dzdy * centreY + polygon.dz));
+            __m128 stepZ = _mm_set1_ps(polygon.dzdx * 4.f);
+            __m128 zero = _mm_setzero_ps();
+            for (int x = start; x <= x1; x += 4)
+            {
+                __m128 inside = _mm_cmpge_ps(edgeValue[0], zero);
+                edgeValue[0] = _mm_add_ps(edgeValue[0], edgeStep[0]);
+                for (int i = 1; i < edgeCount; i++)
+                {
+                    inside = _mm_and_ps(inside, _mm_cmpge_ps(edgeValue[i], zero));
+                    edgeValue[i] = _mm_add_ps(edgeValue[i], edgeStep[i]);
+                }
+                if (_mm_movemask_ps(inside))
+                {
+                    __m128 old = _mm_loadu_ps(row + x);
+                    __m128 nearest = _mm_min_ps(old, z);
+                    _mm_storeu_ps(row + x, _mm_or_ps(_mm_and_ps(inside, nearest), _mm_andnot_ps(inside, old)));
+                }
+                z = _mm_add_ps(z, stepZ);
+            }
+#else
+            for (int x = x0; x <= x1; x++)
+            {
+                float centreX = x + 0.5f;
+                bool inside = true;
+                for (int i = 0; i < edgeCount && inside; i++)
+                    inside = edges[i].a * centreX + edges[i].b * centreY + edges[i].c >= 0.f;
+                if (inside)
+                    row[x] = std::min(row[x], polygon.dzdx * centreX + polygon.dzdy * centreY + polygon.dz);
+            }
+#endif
+        }
+    }
+}
+
+void OcclusionBuffer::buildLevels()
+{
+    for (int level = 1; level < Levels; level++)
+    {
+        const std::vector<float>& below = levels[level - 1];
+        std::vector<float>& above = levels[level];
+        int belowWidth = Width >> (level - 1);
+        int width = Width >> level;
+        int height = Height >> level;
+        for (int y = 0; y < height; y++)
+        {
+            const float* row0 = &below[2 * y * belowWidth];
+            const float* row1 = row0 + belowWidth;
+            for (int x = 0; x < width; x++)
+            {
+                above[y * width + x] = std::max(std::max(row0[2 * x], row0[2 * x + 1]),
+                                                std::max(row1[2 * x], row1[2 * x + 1]));
+            }
+        }
+    }
+}
+
+bool OcclusionBuffer::occluded(const glm::vec3& min, const glm::vec3& max) const
+{
+    if (empty)
+        return false;
+
+    float minX = FAR_DEPTH, minY = FAR_DEPTH, minZ = FAR_DEPTH;
+    float maxX = -FAR_DEPTH, maxY = -FAR_DEPTH;
+    for (int i = 0; i < 8; i++)
+    {
+        glm::vec4 corner((i & 1) ? max.x : min.x, (i & 2) ? max.y : min.y, (i & 4) ? max.z : min.z, 1.f);
+        glm::vec4 p = matrix * corner;
+        // Boxes reaching the near plane are always drawn
+        if (p.w <= 0.f || p.z + p.w < 0.f)
+            return false;
+        float x = (p.x / p.w * 0.5f + 0.5f) * Width;
+        float y = (p.y / p.w * 0.5f + 0.5f) * Height;
+        minX = std::min(minX, x);
+        maxX = std::max(maxX, x);
+        minY = std::min(minY, y);
+        maxY = std::max(maxY, y);
+        minZ = std::min(minZ, p.z / p.w);
+    }
+
+    // Off screen boxes are left to the frustum test
+    if (maxX < 0.f || maxY < 0.f || minX >= Width || minY >= Height)
+        return false;
+    int x0 = std::max(0, (int)std::floor(minX));
+    int x1 = std::min(Width - 1, (int)std::floor(maxX));
+    int y0 = std::max(0, (int)std::floor(minY));
+    int y1 = std::min(Height - 1, (int)std::floor(maxY));
+
+    // The finest level where the box covers at most 4x4 texels
+    int level = 0;
+    while (level < Levels - 1 && ((x1 >> level) - (x0 >> level) > 3 || (y1 >> level) - (y0 >> level) > 3))
+        level++;
+
+    const std::vector<float>& depth = levels[level];
+    int width = Width >> level;
+    for (int y = y0 >> level; y <= y1 >> level; y++)
+    {
+        for (int x = x0 >> level; x <= x1 >> level; x++)
+        {
+            if (depth[y * width + x] >= minZ)
+                return false;
+        }
+    }
+    return true;
+}
+
+int OcclusionBuffer::polygonCount() const
+{
+    return polygonArray.size();
+}
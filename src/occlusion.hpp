@@ -0,0 +1,71 @@
+#ifndef OCCLUSION_HPP
+#define OCCLUSION_HPP
+
+#include <vector>
+#include <glm/glm.hpp>
+
+// Low resolution depth buffer that a few large occluders are drawn into on
+// the CPU, with coarser levels above it holding the farthest depth of the
+// texels they cover. A box is hidden when its nearest point is behind every
+// texel it touches. Occluders only write texels they cover completely, at
+// the farthest depth they reach inside the texel, so a box is never hidden
+// when any of it could be seen.
+class OcclusionBuffer
+{
+public:
+    static const int Width = 256;
+    static const int Height = 128;
+    static const int Levels = 8;
+    // Rows drawn by one job
+    static const int BandHeight = 16;
+    // Corners an occluder may have after clipping
+    static const int MaxCorners = 32;
+
+    OcclusionBuffer();
+
+    // Clears the buffer and the queued polygons
+    void begin(const glm::mat4& matrix);
+    // Queues a convex planar world space polygon, the part in front of the
+    // near plane is kept. Whole polygons are drawn rather than triangles so
+    // the texels along their inner edges are covered too.
+    void addPolygon(const glm::vec3* corners, int count);
+    // Draws the queued polygons, one band of rows per job when parallel,
+    // and builds the coarser levels.
+    void rasterize(bool parallel);
+
+    // Safe to call from several threads once rasterize has returned.
+    bool occluded(const glm::vec3& min, const glm::vec3& max) const;
+
+    int polygonCount() const;
+
+private:
+    // a * x + b * y + c is positive inside, in texels
+    struct Edge
+    {
+        float a;
+        float b;
+        float c;
+    };
+
+    // Screen space bounds, edges and the NDC depth as a plane over x and y
+    struct Polygon
+    {
+        float minX, maxX, minY, maxY;
+        int firstEdge;
+        int edgeCount;
+        float dzdx, dzdy, dz;
+    };
+
+    void addProjected(const glm::vec4* corners, int count);
+    void rasterizeBands(int first, int last);
+    void buildLevels();
+
+    glm::mat4 matrix;
+    std::vector<Polygon> polygonArray;
+    std::vector<Edge> edgeArray;
+    // levels[0] is Width by Height, each level above halves both
+    std::vector<float> levels[Levels];
+    bool empty;
+};
+
+#endif // OCCLUSION_HPP
@@ -0,0 +1,94 @@
+#include "renderstate.hpp"
+
+static const GLenum capabilityNames[RenderState::CapabilityCount] = {
+    GL_BLEND,
+    GL_CULL_FACE,
+    GL_DEPTH_TEST,
+    GL_TEXTURE_2D
+};
+
+// Cached values that cannot match any real state, so the first call after
+// invalidate() always goes through.
+static const GLuint UnknownName = ~0u;
+static const int Unknown = -1;
+
+RenderState::RenderState()
+    : issuedCount(0)
+    , skippedCount(0)
+{
+    invalidate();
+}
+
+void RenderState::invalidate()
+{
+    program = UnknownName;
+    for (int i = 0; i < TextureUnits; i++)
+        textures[i] = UnknownName;
+    activeUnit = Unknown;
+    for (int i = 0; i < CapabilityCount; i++)
+        capabilities[i] = Unknown;
+}
+
+bool RenderState::useProgram(GLuint name)
+{
+    if (program == name)
+    {
+        skippedCount++;
+        return false;
+    }
+    glUseProgram(name);
+    program = name;
+    issuedCount++;
+    return true;
+}
+
+bool RenderState::bindTexture(int unit, GLuint texture, GLenum target)
+{
+    if (textures[unit] == texture)
+    {
+        skippedCount++;
+        return false;
+    }
+    if (activeUnit != unit)
+    {
+        glActiveTexture(GL_TEXTURE0 + unit);
+        activeUnit = unit;
+        issuedCount++;
+    }
+    glBindTexture(target, texture);
+    textures[unit] = texture;
+    issuedCount++;
+    return true;
+}
+
+bool RenderState::setEnabled(Capability capability, bool enabled)
+{
+    if (capabilities[capability] == (int)enabled)
+    {
+        skippedCount++;
+        return false;
+    }
+    if (enabled)
+        glEnable(capabilityNames[capability]);
+    else
+        glDisable(capabilityNames[capability]);
+    capabilities[capability] = enabled;
+    issuedCount++;
+    return true;
+}
+
+unsigned int RenderState::issued() const
+{
+    return issuedCount;
+}
+
+unsigned int RenderState::skipped() const
+{
+    return skippedCount;
+}
+
+void RenderState::resetCounters()
+{
+    issuedCount = 0;
+    skippedCount = 0;
+}
@@ -0,0 +1,46 @@
+#ifndef RENDERSTATE_HPP
+#define RENDERSTATE_HPP
+
+#include <GL/glew.h>
+
+// Shadow copy of the GL state the renderer touches. Calls that would not
+// change anything are dropped before they reach the driver. Anything else
+// that changes GL state behind its back must call invalidate().
+class RenderState
+{
+public:
+    enum Capability
+    {
+        Blend,
+        CullFace,
+        DepthTest,
+        Texture2D,
+        CapabilityCount
+    };
+
+    static const int TextureUnits = 4;
+
+    RenderState();
+
+    void invalidate();
+
+    bool useProgram(GLuint program);
+    // Each unit is expected to be used with a single target.
+    bool bindTexture(int unit, GLuint texture, GLenum target = GL_TEXTURE_2D);
+    bool setEnabled(Capability capability, bool enabled);
+
+    unsigned int issued() const;
+    unsigned int skipped() const;
+    void resetCounters();
+
+private:
+    GLuint program;
+    GLuint textures[TextureUnits];
+    int activeUnit;
+    int capabilities[CapabilityCount];
+
+    unsigned int issuedCount;
+    unsigned int skippedCount;
+};
+
+#endif // RENDERSTATE_HPP
@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <SFML/Graphics/Image.hpp>
+#include "texture.hpp"
+
+bool decodeTexture(sf::InputStream& stream, TextureData& data)
+{
+    sf::Image image;
+    if (!image.loadFromStream(stream))
+        return false;
+
+    createTexture(image.getSize().x, image.getSize().y, image.getPixelsPtr(), data);
+    generateMipmaps(data);
+    return true;
+}
+
+bool decodeTexture(const std::vector<char>& file, TextureData& data)
+{
+    sf::Image image;
+    if (file.empty() || !image.loadFromMemory(&file[0], file.size()))
+        return false;
+
+    createTexture(image.getSize().x, image.getSize().y, image.getPixelsPtr(), data);
+    generateMipmaps(data);
+    return true;
+}
+
+void createTexture(unsigned int width, unsigned int height, const unsigned char* pixels, TextureData& data)
+{
+    data.width = width;
+    data.height = height;
+    data.levels.resize(1);
+    data.levels[0].assign(pixels, pixels + width * height * 4);
+}
+
+void generateMipmaps(TextureData& data)
+{
+    if (data.levels.empty())
+        return;
+    data.levels.resize(1);
+
+    unsigned int width = data.width;
+    unsigned int height = data.height;
+    while (width > 1 || height > 1)
+    {
+        unsigned int mipWidth = std::max(width / 2, 1u);
+        unsigned int mipHeight = std::max(height / 2, 1u);
+        std::vector<unsigned char> mip(mipWidth * mipHeight * 4);
+        const std::vector<unsigned char>& src = data.levels.back();
+
+        for (unsigned int y = 0; y < mipHeight; y++)
+        {
+            unsigned int y0 = std::min(y * 2, height - 1);
+            unsigned int y1 = std::min(y * 2 + 1, height - 1);
+            for (unsigned int x = 0; x < mipWidth; x++)
+            {
+                unsigned int x0 = std::min(x * 2, width - 1);
+                unsigned int x1 = std::min(x * 2 + 1, width - 1);
+                for (unsigned int c = 0; c < 4; c++)
+                {
+                    unsigned int sum = src[(y0 * width + x0) * 4 + c]
+                        + src[(y0 * width + x1) * 4 + c]
+                        + src[(y1 * width + x0) * 4 + c]
+                        + src[(y1 * width + x1) * 4 + c];
+                    mip[(y * mipWidth + x) * 4 + c] = (sum + 2) / 4;
+                }
+            }
+        }
+
+        data.levels.push_back(mip);
+        width = mipWidth;
+        height = mipHeight;
+    }
+}
+
+GLuint uploadTexture(const TextureData& data)
+{
+    if (data.levels.empty())
+        return 0;
+
+    GLuint texture;
+    glGenTextures(1, &texture);
+    glBindTexture(GL_TEXTURE_2D, texture);
+
+    unsigned int width = data.width;
+    unsigned int height = data.height;
+    for (size_t i = 0; i < data.levels.size(); i++)
+    {
+        glTexImage2D(GL_TEXTURE_2D, i, GL_RGBA8, width, height, 0, GL_RGBA, GL_UNSIGNED_BYTE, &data.levels[i][0]);
+        width = std::max(width / 2, 1u);
+        height = std::max(height / 2, 1u);
+    }
+
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAX_LEVEL, data.levels.size() - 1);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_S, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_WRAP_T, GL_REPEAT);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MAG_FILTER, GL_LINEAR);
+    glTexParameteri(GL_TEXTURE_2D, GL_TEXTURE_MIN_FILTER,
+        data.levels.size() > 1 ? GL_LINEAR_MIPMAP_LINEAR : GL_LINEAR);
+
+    glBindTexture(GL_TEXTURE_2D, 0);
+    return texture;
+}
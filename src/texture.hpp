@@ -0,0 +1,27 @@
+#ifndef TEXTURE_HPP
+#define TEXTURE_HPP
+
+#include <vector>
+#include <GL/glew.h>
+#include <SFML/System/InputStream.hpp>
+
+// Decoded RGBA8 pixels with the full mip chain, level 0 first. Decoding
+// does not touch GL and can be done on any thread.
+struct TextureData
+{
+    unsigned int width;
+    unsigned int height;
+    std::vector<std::vector<unsigned char> > levels;
+
+    TextureData() : width(0), height(0) {}
+};
+
+bool decodeTexture(sf::InputStream& stream, TextureData& data);
+bool decodeTexture(const std::vector<char>& file, TextureData& data);
+void createTexture(unsigned int width, unsigned int height, const unsigned char* pixels, TextureData& data);
+void generateMipmaps(TextureData& data);
+
+// Must be called on the GL thread.
+GLuint uploadTexture(const TextureData& data);
+
+#endif // TEXTURE_HPP
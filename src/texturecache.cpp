@@ -0,0 +1,208 @@
+#include <algorithm>
+#include <cstdio>
+#include <cstring>
+#include <sstream>
+#include <sys/stat.h>
+#include <physfs.h>
+#include "hash.hpp"
+#include "mappedfile.hpp"
+#include "texturecache.hpp"
+
+#ifdef _WIN32
+#include <process.h>
+#define getpid _getpid
+#else
+#include <unistd.h>
+#endif
+
+const int TEXTURECACHE_VERSION = 1;
+
+struct TextureCacheHeader
+{
+    char magic[4];
+    int version;
+    unsigned int width;
+    unsigned int height;
+    unsigned int levelCount;
+    unsigned int keyLength;
+};
+
+TextureCache::TextureCache()
+    : fileIndex(NULL)
+    , hitCount(0)
+    , missCount(0)
+    , tempCount(0)
+{
+}
+
+void TextureCache::setDirectory(const std::string& dir)
+{
+    directory = dir;
+}
+
+void TextureCache::setFileIndex(const FileIndex* index)
+{
+    fileIndex = index;
+}
+
+bool TextureCache::enabled() const
+{
+    return !directory.empty();
+}
+
+bool TextureCache::load(const std::string& path, TextureData& data)
+{
+    if (!enabled())
+        return false;
+
+    std::string entryKey = key(path);
+    MappedFile file;
+    ArrayView<TextureCacheHeader> headerView;
+    if (!file.openNative(entryPath(entryKey)) ||
+        !file.view(0, sizeof(TextureCacheHeader), headerView) || headerView.empty())
+    {
+        missCount++;
+        return false;
+    }
+
+    const TextureCacheHeader& header = headerView[0];
+    ArrayView<char> storedKey;
+    if (std::string(header.magic, 4) != "BSPT" ||
+        header.version != TEXTURECACHE_VERSION ||
+        header.levelCount == 0 ||
+        !file.view(sizeof(TextureCacheHeader), header.keyLength, storedKey) ||
+        std::string(storedKey.begin(), storedKey.end()) != entryKey)
+    {
+        missCount++;
+        return false;
+    }
+
+    // A full chain from the largest side down to 1x1 is the most there can
+    // be, anything longer is a damaged entry
+    unsigned int maxLevels = 1;
+    for (unsigned int side = std::max(header.width, header.height); side > 1; side /= 2)
+        maxLevels++;
+    if (header.levelCount > maxLevels)
+    {
+        missCount++;
+        return false;
+    }
+
+    data.width = header.width;
+    data.height = header.height;
+    data.levels.resize(header.levelCount);
+
+    std::size_t offset = sizeof(TextureCacheHeader) + header.keyLength;
+    unsigned int width = header.width;
+    unsigned int height = header.height;
+    for (unsigned int i = 0; i < header.levelCount; i++)
+    {
+        ArrayView<unsigned char> level;
+        std::size_t size = (std::size_t)width * height * 4;
+        if (!file.view(offset, size, level) || level.size() != size)
+        {
+            data = TextureData();
+            missCount++;
+            return false;
+        }
+        data.levels[i].assign(level.begin(), level.end());
+        offset += size;
+        width = width > 1 ? width / 2 : 1;
+        height = height > 1 ? height / 2 : 1;
+    }
+
+    hitCount++;
+    return true;
+}
+
+bool TextureCache::store(const std::string& path, const TextureData& data)
+{
+    if (!enabled() || data.levels.empty())
+        return false;
+
+    std::string entryKey = key(path);
+
+    TextureCacheHeader header;
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, "BSPT", 4);
+    header.version = TEXTURECACHE_VERSION;
+    header.width = data.width;
+    header.height = data.height;
+    header.levelCount = data.levels.size();
+    header.keyLength = entryKey.length();
+
+    // Several shaders can share a texture and several viewers the cache
+    // directory, so each writer gets its own temporary file.
+    std::string target = entryPath(entryKey);
+    std::ostringstream temp;
+    temp << target << "." << getpid() << "." << tempCount++ << ".tmp";
+    FILE* out = fopen(temp.str().c_str(), "wb");
+    if (!out)
+        return false;
+
+    bool ok = fwrite(&header, sizeof(header), 1, out) == 1;
+    ok = ok && fwrite(entryKey.data(), entryKey.length(), 1, out) == 1;
+    for (size_t i = 0; ok && i < data.levels.size(); i++)
+        ok = fwrite(&data.levels[i][0], data.levels[i].size(), 1, out) == 1;
+    ok = (fclose(out) == 0) && ok;
+
+    if (ok)
+    {
+        remove(target.c_str());
+        ok = rename(temp.str().c_str(), target.c_str()) == 0;
+    }
+    if (!ok)
+        remove(temp.str().c_str());
+    return ok;
+}
+
+unsigned int TextureCache::hits() const
+{
+    return hitCount;
+}
+
+unsigned int TextureCache::misses() const
+{
+    return missCount;
+}
+
+void TextureCache::resetCounters()
+{
+    hitCount = 0;
+    missCount = 0;
+}
+
+std::string TextureCache::key(const std::string& path) const
+{
+    const FileIndex::Entry* entry = fileIndex ? fileIndex->find(path) : NULL;
+    if (entry)
+    {
+        std::ostringstream key;
+        key << fileIndex->archive(*entry) << "\n" << entry->path << "\n" << entry->modTime;
+        return key.str();
+    }
+
+    const char* realDir = PHYSFS_getRealDir(path.c_str());
+    std::string archive = realDir ? realDir : "";
+
+    long long modTime = 0;
+    struct stat info;
+    if (!archive.empty() && stat(archive.c_str(), &info) == 0)
+    {
+        modTime = info.st_mtime;
+        // Loose files in a directory change independently of it
+        if ((info.st_mode & S_IFDIR) != 0)
+            modTime = PHYSFS_getLastModTime(path.c_str());
+    }
+
+    std::ostringstream key;
+    key << archive << "\n" << path << "\n" << modTime;
+    return key.str();
+}
+
+std::string TextureCache::entryPath(const std::string& key) const
+{
+    char name[32];
+    snprintf(name, sizeof(name), "%016llx.tex", hashString(key));
+    return directory + PHYSFS_getDirSeparator() + name;
+}
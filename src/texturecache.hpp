@@ -0,0 +1,40 @@
+#ifndef TEXTURECACHE_HPP
+#define TEXTURECACHE_HPP
+
+#include <atomic>
+#include <string>
+#include "fileindex.hpp"
+#include "texture.hpp"
+
+// On-disk store of decoded mip chains. Entries are named by a hash of the
+// archive the texture came from, its path inside the archive and the
+// archive's modification time, so any change to a pk3 invalidates them.
+// Safe to use from several threads at once.
+class TextureCache
+{
+public:
+    TextureCache();
+
+    void setDirectory(const std::string& dir);
+    void setFileIndex(const FileIndex* index);
+    bool enabled() const;
+
+    bool load(const std::string& path, TextureData& data);
+    bool store(const std::string& path, const TextureData& data);
+
+    unsigned int hits() const;
+    unsigned int misses() const;
+    void resetCounters();
+
+private:
+    std::string key(const std::string& path) const;
+    std::string entryPath(const std::string& key) const;
+
+    std::string directory;
+    const FileIndex* fileIndex;
+    std::atomic<unsigned int> hitCount;
+    std::atomic<unsigned int> missCount;
+    std::atomic<unsigned int> tempCount;
+};
+
+#endif // TEXTURECACHE_HPP